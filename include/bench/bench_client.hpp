@@ -0,0 +1,178 @@
+/**
+* @file bench_client.hpp
+* @brief Blocking client used by the benchmarks to drive a server.
+*
+* It speaks the same protocol as the connection_manager but without the
+* stdin loop, so a benchmark can send as many requests as it wants and
+* time the responses.
+*/
+
+#ifndef BENCH_CLIENT_HPP
+#define BENCH_CLIENT_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "utils/crypto.hpp"
+#include "utils/types.h"
+
+class bench_client
+{
+public:
+	using tcp = boost::asio::ip::tcp;
+
+	/// @brief Connects to the server on localhost and logs in.
+	/// @param features The features to offer, 0 logs in like a legacy client
+	bench_client(boost::asio::io_context& io_context,
+				 uint16_t port,
+				 const std::string& username,
+				 const std::string& password,
+				 uint32_t features = 0)
+		: socket_(io_context)
+	{
+		socket_.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+		socket_.set_option(tcp::no_delay(true));
+
+		LoginRequest login{};
+		login.header.msg_type = LOGIN_REQUEST;
+		login.header.msg_seq = msg_seq_++;
+		login.header.msg_size = htons(static_cast<uint16_t>(
+			sizeof(LoginRequest) + (features != 0 ? sizeof(LoginCapabilities) : 0)));
+		std::strncpy(login.username, username.c_str(), sizeof(login.username));
+		std::strncpy(login.password, password.c_str(), sizeof(login.password));
+		username_sum_ = compute_checksum_cstr(login.username, sizeof(login.username));
+		password_sum_ = compute_checksum_cstr(login.password, sizeof(login.password));
+
+		LoginCapabilities capabilities;
+		capabilities.version = htons(PROTOCOL_VERSION);
+		capabilities.features = htonl(features);
+		capabilities.nonce = htonl(0x5EED0000u ^ username_sum_);
+
+		std::array<boost::asio::const_buffer, 2> request = {
+			boost::asio::buffer(&login, sizeof(login)),
+			boost::asio::buffer(&capabilities, features != 0 ? sizeof(capabilities) : 0)};
+		boost::asio::write(socket_, request);
+
+		PacketHeader header = read_frame();
+		if(header.msg_type != LOGIN_RESPONSE || body_.size() < sizeof(uint16_t) || body_[1] != 1)
+		{
+			throw std::runtime_error("login failed for " + username);
+		}
+
+		if(body_.size() >= sizeof(uint16_t) + sizeof(LoginCapabilities))
+		{
+			LoginCapabilities accepted;
+			std::memcpy(&accepted, body_.data() + sizeof(uint16_t), sizeof(accepted));
+			features_ = ntohl(accepted.features) & features;
+			if(features_ & FEATURE_CHACHA20)
+			{
+				chacha_key_ = derive_chacha20_key(
+					username_sum_, password_sum_, ntohl(capabilities.nonce), ntohl(accepted.nonce));
+			}
+		}
+	}
+
+	/// @brief Returns the features the server enabled for this connection.
+	uint32_t features() const { return features_; }
+
+	/// @brief Appends an encrypted echo (or broadcast) request to a batch of frames.
+	void append_echo(std::vector<char>& out,
+					 const std::string& message,
+					 MessageType type = ECHO_REQUEST)
+	{
+		EchoRequest request{};
+		request.header.msg_type = type;
+		request.header.msg_seq = msg_seq_;
+		request.header.msg_size = htons(static_cast<uint16_t>(sizeof(EchoRequest) + message.size()));
+		request.msg_size = htons(static_cast<uint16_t>(message.size()));
+
+		uint16_t payload_len = static_cast<uint16_t>(message.size());
+		std::vector<uint8_t> cipher;
+		if(features_ & FEATURE_CHACHA20)
+		{
+			cipher = chacha20_operation(payload_len, chacha_key_, msg_seq_, message.data());
+		}
+		else
+		{
+			uint32_t key_state = compute_initial_key(msg_seq_, username_sum_, password_sum_);
+			cipher = xor_operation(payload_len, key_state, message);
+		}
+		++msg_seq_;
+
+		const char* raw = reinterpret_cast<const char*>(&request);
+		out.insert(out.end(), raw, raw + sizeof(EchoRequest));
+		out.insert(out.end(), cipher.begin(), cipher.end());
+	}
+
+	/// @brief Sends one echo request and waits for its response.
+	std::string echo(const std::string& message)
+	{
+		out_.clear();
+		append_echo(out_, message);
+		boost::asio::write(socket_, boost::asio::buffer(out_));
+		return read_echo();
+	}
+
+	/// @brief Reads frames until an echo response arrives and returns its payload.
+	std::string read_echo()
+	{
+		for(;;)
+		{
+			PacketHeader header = read_frame();
+			if(header.msg_type == ECHO_RESPONSE && body_.size() >= sizeof(uint16_t))
+			{
+				return std::string(body_.begin() + sizeof(uint16_t), body_.end());
+			}
+		}
+	}
+
+	/// @brief Reads the next frame, the payload is left in body().
+	PacketHeader read_frame()
+	{
+		PacketHeader header;
+		boost::asio::read(socket_, boost::asio::buffer(&header, sizeof(header)));
+		header.msg_size = ntohs(header.msg_size);
+		if(header.msg_size < sizeof(PacketHeader))
+		{
+			throw std::runtime_error("invalid frame size");
+		}
+		body_.resize(header.msg_size - sizeof(PacketHeader));
+		boost::asio::read(socket_, boost::asio::buffer(body_));
+		return header;
+	}
+
+	const std::vector<char>& body() const { return body_; }
+
+	tcp::socket& socket() { return socket_; }
+
+private:
+	tcp::socket socket_;
+	std::vector<char> out_;
+	std::vector<char> body_;
+	uint8_t msg_seq_{0};
+	uint8_t username_sum_{0};
+	uint8_t password_sum_{0};
+	uint32_t features_{0};
+	chacha20_key chacha_key_{};
+};
+
+/// @brief Returns the requested percentile of the samples, the samples get sorted.
+template <typename T>
+inline T percentile(std::vector<T>& samples, double p)
+{
+	if(samples.empty())
+	{
+		return T{};
+	}
+	std::sort(samples.begin(), samples.end());
+	size_t index = static_cast<size_t>(p / 100.0 * (samples.size() - 1));
+	return samples[index];
+}
+
+#endif // BENCH_CLIENT_HPP
@@ -4,7 +4,9 @@
 *
 * This header contains the class that manages the client's 
 * connection with the server and tells what requests can be
-* sent to the server.
+* sent to the server. The interactive client runs it over a TCP
+* socket and stdin, the in-process bench over a memory_stream with
+* handlers receiving the responses.
 */
 
 #ifndef CONNECTION_MANAGER_H
@@ -12,8 +14,11 @@
 
 #include <boost/asio.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <string_view>
 #include <netinet/in.h>
 
 #include "utils/crypto.hpp"
@@ -22,19 +27,59 @@
 using boost::asio::ip::tcp;
 namespace posix = boost::asio::posix;
 
-class connection_manager : public std::enable_shared_from_this<connection_manager>
+/// Receives the responses instead of stdout when the client is not interactive.
+struct client_handlers
+{
+	/// Called with the outcome of the login
+	std::function<void(bool logged_in)> login;
+
+	/// Called with every echoed message
+	std::function<void(const char* message, size_t size)> echo;
+
+	/// Called with every broadcast, prefixed with the client_id that sent it
+	std::function<void(const char* message, size_t size)> broadcast;
+};
+
+/// Instantiated for tcp::socket and memory_stream in connection_manager.cpp
+template <typename Stream>
+class basic_connection_manager
+	: public std::enable_shared_from_this<basic_connection_manager<Stream>>
 {
 public:
-	connection_manager(boost::asio::io_context& io_context,
-					   const std::string& username,
-					   const std::string& password);
+	/// @brief Interactive client, connects to the server and sends what is typed on stdin.
+	/// Only available for tcp::socket.
+	basic_connection_manager(boost::asio::io_context& io_context,
+							 const std::string& username,
+							 const std::string& password);
 
+	/// @brief Client driven by code over an already connected stream.
+	basic_connection_manager(Stream stream,
+							 const std::string& username,
+							 const std::string& password,
+							 client_handlers handlers);
+
+	/// @brief Connects if needed and logs in.
 	void start();
 
+	/// @brief Method to send a message to the server, based on the cipher
+	/// negotiated at login it encrypts the plain text and writes it to the
+	/// stream. Echo and broadcast requests share the same layout.
+	/// @param type ECHO_REQUEST or BROADCAST_REQUEST
+	void send_request(MessageType type, std::string_view message);
+
+	/// @brief Closes the connection, the pending operations complete with an error.
+	void stop() { stream_.close(); }
+
+	/// @brief Returns the features negotiated with the server.
+	uint32_t features() const { return features_; }
+
 private:
-	tcp::resolver resolver_;
-	tcp::socket socket_;
-	posix::stream_descriptor stdin_;
+	using std::enable_shared_from_this<basic_connection_manager<Stream>>::shared_from_this;
+
+	std::optional<tcp::resolver> resolver_;
+	Stream stream_;
+	std::optional<posix::stream_descriptor> stdin_;
+	client_handlers handlers_;
 	std::array<char, 512> input_buffer_;
 	PacketHeader in_header_;
 	std::vector<char> in_body_;
@@ -43,8 +88,12 @@ private:
 	uint8_t msg_seq_;
 	uint8_t username_sum_{0};
 	uint8_t password_sum_{0};
+	uint32_t client_nonce_{0};
+	uint32_t features_{0};
+	chacha20_key chacha_key_{};
 
 	static constexpr size_t max_length = 512;
+	static constexpr std::string_view broadcast_prefix = "/all ";
 
 	/// @brief Based on an address and a port tries to find if
 	/// the connection can be established and provides an endpoint
@@ -55,8 +104,12 @@ private:
 	/// associate the endpoint with a socket.
 	void establish_connection(const tcp::resolver::results_type& endpoint);
 
+	/// @brief Sends the login and starts reading the responses.
+	void on_connected();
+
 	/// @brief Creates a packet that contains the username and password
-	/// and sends it to the server to try and log in.
+	/// followed by the capabilities of the client and sends it to the
+	/// server to try and log in.
 	void send_login_request();
 
 	/// @brief Method that ensures the looping of the client, it reads
@@ -64,12 +117,7 @@ private:
 	///	then it send the packet and goes back to the same state.
 	void start_reading_input();
 
-	/// @brief Method to send a message to the server, based on the lcg
-	/// provided it computes a key to encrypt the plain text and writes
-	/// it to the socket.
-	void send_echo_request(const std::string& message);
-	
-	/// @brief Reads from the socket the length of the header and if no 
+	/// @brief Reads from the stream the length of the header and if no 
 	/// error is caught transalte form network to host and proceed in 
 	/// reading the body.
 	void read_packet_header();
@@ -83,11 +131,32 @@ private:
 	void handle_server_packet();
 	
 	/// @brief Based on the response either start reading from stdin and
-	///  enable the packet processing loop or disconnect the client
+	///  enable the packet processing loop or disconnect the client. A server
+	///  that negotiated capabilities tells which features are enabled, an
+	///  older one answers without them and the LCG is used.
 	void handle_login_response();
 	
-	/// @brief Receive the data and prints it in stdout.
+	/// @brief Receive the data and prints it in stdout, or hands it to the echo handler.
 	void handle_echo_response();
+
+	/// @brief Prints a message another client broadcasted to everybody, or hands
+	/// it to the broadcast handler.
+	void handle_broadcast_message();
 };
 
+// The interactive constructor and the connection setup only exist for TCP,
+// they are specialized in connection_manager.cpp
+template <>
+basic_connection_manager<tcp::socket>::basic_connection_manager(boost::asio::io_context& io_context,
+																 const std::string& username,
+																 const std::string& password);
+
+template <>
+void basic_connection_manager<tcp::socket>::resolve_connection();
+
+template <>
+void basic_connection_manager<tcp::socket>::establish_connection(const tcp::resolver::results_type& endpoint);
+
+using connection_manager = basic_connection_manager<tcp::socket>;
+
 #endif // CONNECTION_MANAGER_H
\ No newline at end of file
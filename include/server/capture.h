@@ -0,0 +1,122 @@
+/**
+* @file capture.h
+* @brief Recording of the framed traffic of every connection.
+*
+* The sessions hand every frame they read or write to a capture_writer
+* together with a timestamp, the connection it belongs to and its
+* direction. The frames are buffered in memory and a background thread
+* writes them to the capture file, the replay tool maps the file back
+* with capture_reader.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+// Followed by size bytes holding exactly one frame, header included
+struct CaptureRecord
+{
+	uint64_t timestamp_ns;
+	uint64_t connection;
+	uint8_t direction;
+	uint8_t reserved;
+	uint16_t size;
+};
+#pragma pack(pop)
+
+enum CaptureDirection : uint8_t
+{
+	CLIENT_TO_SERVER = 0,
+	SERVER_TO_CLIENT = 1
+};
+
+class capture_writer
+{
+public:
+	/// @brief Creates the capture file, throws std::runtime_error on failure.
+	/// @param max_buffered Bytes kept in memory while the disk is behind, past it frames are dropped
+	explicit capture_writer(const std::string& path, size_t max_buffered = 64 * 1024 * 1024);
+
+	/// @brief Writes the buffered frames and closes the file.
+	~capture_writer();
+
+	capture_writer(const capture_writer&) = delete;
+	capture_writer& operator=(const capture_writer&) = delete;
+
+	/// @brief Records a frame, it can be given in two parts when its header and
+	/// payload live in different buffers. Never waits on the disk.
+	void record(uint64_t connection,
+				CaptureDirection direction,
+				const void* data,
+				size_t size,
+				const void* extra = nullptr,
+				size_t extra_size = 0);
+
+	/// @brief Returns how many frames were dropped.
+	uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+	int fd_{-1};
+	std::string path_;
+	size_t max_buffered_;
+	std::atomic<uint64_t> dropped_{0};
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::vector<char> pending_;
+	bool stopping_{false};
+	std::thread flusher_;
+
+	/// @brief Body of the thread writing the buffered frames to the file.
+	void run_flusher();
+
+	/// @brief Writes the whole buffer to the file.
+	void write_all(const std::vector<char>& buffer);
+};
+
+struct capture_entry
+{
+	uint64_t timestamp_ns;
+	uint64_t connection;
+	CaptureDirection direction;
+	const char* data;
+	uint16_t size;
+};
+
+class capture_reader
+{
+public:
+	/// @brief Maps a capture file, throws std::runtime_error if it is not one.
+	explicit capture_reader(const std::string& path);
+	~capture_reader();
+
+	capture_reader(const capture_reader&) = delete;
+	capture_reader& operator=(const capture_reader&) = delete;
+
+	/// @brief Reads the next frame, the data points into the mapping and stays
+	/// valid as long as the reader. Returns false at the end of the file.
+	bool next(capture_entry& entry);
+
+private:
+	int fd_{-1};
+	const char* data_{nullptr};
+	size_t size_{0};
+	size_t offset_{0};
+};
+
+#endif // CAPTURE_H
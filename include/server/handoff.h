@@ -0,0 +1,131 @@
+/**
+* @file handoff.h
+* @brief Moves the listening socket and the live sessions to a new server process.
+*
+* The running server listens on a Unix socket. A new server connects to
+* it and receives, with SCM_RIGHTS, first the listening socket, so it
+* accepts the new connections right away, then every session frozen
+* between two frames together with its state. The clients keep their
+* connection and never log in again.
+*
+* The new server builds everything that can fail before it connects and
+* answers HANDOFF_ACK once it has everything, only then the old server
+* stops. Until then the old server keeps the listening socket and every
+* session, socket and state: if the new one fails halfway it accepts
+* again and serves them all as if nothing happened.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "server/session_manager.h"
+
+#pragma pack(push, 1)
+// Every message of the handoff socket starts with this header, the
+// listening and the session sockets travel with their message
+struct HandoffMessage
+{
+	uint8_t type;
+	uint32_t size;
+};
+
+// Body of a HANDOFF_SESSION message, followed by the client id, the input and the output
+struct HandoffSession
+{
+	uint8_t logged_in;
+	uint8_t username_sum;
+	uint8_t password_sum;
+	uint8_t broadcast_seq;
+	uint32_t features;
+	uint32_t chacha_key[8];
+	uint16_t client_id_size;
+	uint32_t input_size;
+	uint32_t output_size;
+	uint32_t captured_size;
+};
+#pragma pack(pop)
+
+enum HandoffMessageType : uint8_t
+{
+	HANDOFF_LISTENER = 1,
+	HANDOFF_SESSION = 2,
+	HANDOFF_END = 3,
+	HANDOFF_ACK = 4, // From the new server, it owns everything from now on
+};
+
+/// @brief Serializes a session, without its socket, as the body of a HANDOFF_SESSION message.
+std::vector<char> encode_session_handoff(const session_handoff& state);
+
+/// @brief Parses the body of a HANDOFF_SESSION message, returns false if it is malformed.
+bool decode_session_handoff(const char* data, size_t size, session_handoff& state);
+
+class handoff_listener
+{
+public:
+	/// @brief Binds the Unix socket a new server connects to, it is served once
+	/// start() is called. When the handoff is acknowledged on_done is called.
+	/// Throws boost::system::system_error if the socket can't be bound.
+	/// @param staged Bind beside path (path + ".next") and move there with
+	/// publish(), a server taking over binds before the old one lets go of path
+	handoff_listener(boost::asio::io_context& io_context,
+					 const std::string& path,
+					 std::function<void()> on_done,
+					 bool staged = false);
+
+	/// @brief Waits for a handoff in progress, removes the socket file if no
+	/// server took over (the new one moved its own socket over it).
+	~handoff_listener();
+
+	handoff_listener(const handoff_listener&) = delete;
+	handoff_listener& operator=(const handoff_listener&) = delete;
+
+	/// @brief Starts waiting for a new server, manager's listener and sessions are the ones handed off.
+	void start(session_manager& manager);
+
+	/// @brief Moves a staged socket to its path, the old server no longer uses it.
+	/// @return false if it failed, the next server then has to take over from the staged path
+	bool publish();
+
+private:
+	boost::asio::local::stream_protocol::acceptor acceptor_;
+	session_manager* manager_{nullptr};
+
+	// Once the sessions are released nothing else may keep the io_context running
+	std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_;
+	std::string path_;
+	std::string bound_path_;
+	std::function<void()> on_done_;
+	std::thread worker_;
+	std::atomic<bool> handed_off_{false};
+
+	void do_accept();
+
+	/// @brief Body of the worker thread, sends everything over the connected
+	/// socket and serves it all again if the new server doesn't acknowledge.
+	void run_handoff(int fd);
+};
+
+/// @brief Connects to the server listening on path and takes over its listening
+/// socket and its sessions. Returns once all of them are adopted and the
+/// handoff acknowledged. The io_context must not run yet: the sessions only
+/// start with it, once the old server let go of them.
+/// Throws std::runtime_error if the handoff fails while the old server still
+/// runs, it then serves everything again. If it exited halfway the sessions
+/// taken over so far are kept, like a session that can't be adopted that is
+/// only reported.
+/// @param context Built beforehand, with its journal and capture file
+std::unique_ptr<session_manager> take_over(boost::asio::io_context& io_context,
+										   std::shared_ptr<server_context> context,
+										   const std::string& path);
+
+#endif // HANDOFF_H
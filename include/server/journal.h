@@ -0,0 +1,193 @@
+/**
+* @file journal.h
+* @brief Append only binary journal of the echoed messages.
+*
+* Every io_context thread appends to its own ring buffer in anonymous
+* memory, so a record is just a memcpy and never waits on the disk. No
+* file page is mapped by the io threads, so writeback can't fault them.
+* A flusher thread drains the rings into the segment files of their
+* writers, syncs them every fsync interval (group commit) and starts a
+* new segment when one is full. Segments can be scanned with
+* journal_segment_reader.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#pragma pack(push, 1)
+struct JournalSegmentHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t writer;
+	uint64_t segment;
+};
+
+// Records are 8 byte aligned and followed by the client id and the message.
+// A size of 0 marks the end of the segment.
+struct JournalRecord
+{
+	uint32_t size;
+	uint32_t checksum;
+	uint64_t timestamp_ns;
+	uint32_t seq;
+	uint16_t client_id_size;
+	uint16_t message_size;
+};
+#pragma pack(pop)
+
+struct journal_options
+{
+	/// Directory the segments are written to
+	std::string directory;
+
+	/// Size every segment is preallocated with
+	size_t segment_size{64 * 1024 * 1024};
+
+	/// Size of the ring buffer of every writer, the records appended while the
+	/// flusher is behind by more than this are dropped
+	size_t buffer_size{4 * 1024 * 1024};
+
+	/// How often the written records are synced to disk, 0 leaves it to the OS
+	std::chrono::milliseconds fsync_interval{100};
+
+	/// Number of threads that append, each one gets its own segments
+	size_t writers{1};
+};
+
+class journal
+{
+public:
+	/// @brief Creates the directory and the first segment of every writer,
+	/// numbered after the segments already in the directory. Throws
+	/// std::runtime_error when they can't be created.
+	explicit journal(const journal_options& options);
+
+	/// @brief Syncs everything that was appended and trims the last segments.
+	~journal();
+
+	journal(const journal&) = delete;
+	journal& operator=(const journal&) = delete;
+
+	/// @brief Appends a record to the ring buffer of the calling thread. When the
+	/// flusher is behind and the ring is full the record is dropped, the caller
+	/// is never blocked on the disk.
+	void append(const std::string& client_id, uint32_t seq, const uint8_t* message, size_t size);
+
+	/// @brief Returns how many records were appended.
+	uint64_t records() const { return records_.load(std::memory_order_relaxed); }
+
+	/// @brief Returns how many records were dropped.
+	uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+	/// Only touched by the flusher, and by the constructor and destructor
+	struct segment
+	{
+		std::string path;
+		int fd{-1};
+		size_t capacity{0};
+		size_t written{0};
+		size_t synced{0};
+	};
+
+	struct writer
+	{
+		uint32_t index{0};
+		uint64_t next_segment{0};
+
+		// Ring of whole records, head and tail count the bytes ever appended and drained
+		char* ring{nullptr};
+		size_t ring_size{0};
+		std::atomic<uint64_t> head{0};
+		std::atomic<uint64_t> tail{0};
+
+		std::unique_ptr<segment> file;
+	};
+
+	const journal_options options_;
+	const uint64_t id_;
+	std::vector<std::unique_ptr<writer>> writers_;
+	std::atomic<size_t> next_writer_{0};
+	std::atomic<uint64_t> records_{0};
+	std::atomic<uint64_t> dropped_{0};
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	bool work_pending_{false};
+	bool stopping_{false};
+	std::thread flusher_;
+
+	/// @brief Returns the writer of the calling thread, nullptr if there are more
+	/// threads appending than writers.
+	writer* local_writer();
+
+	/// @brief Creates and preallocates the next segment of a writer and writes its header.
+	std::unique_ptr<segment> create_segment(writer& w);
+
+	/// @brief Moves the records of a writer's ring to its segment files.
+	void drain(writer& w);
+
+	/// @brief Syncs what was written to a segment to disk.
+	void sync_segment(segment& s);
+
+	/// @brief Syncs a full segment and trims it to the written size.
+	void close_segment(std::unique_ptr<segment> s);
+
+	/// @brief Body of the flusher thread.
+	void run_flusher();
+};
+
+struct journal_entry
+{
+	uint32_t seq;
+	uint64_t timestamp_ns;
+	std::string_view client_id;
+	std::string_view message;
+};
+
+class journal_segment_reader
+{
+public:
+	/// @brief Maps a segment for sequential reading, throws std::runtime_error
+	/// if the file is not a journal segment.
+	explicit journal_segment_reader(const std::string& path);
+	~journal_segment_reader();
+
+	journal_segment_reader(const journal_segment_reader&) = delete;
+	journal_segment_reader& operator=(const journal_segment_reader&) = delete;
+
+	const JournalSegmentHeader& header() const
+	{
+		return *reinterpret_cast<const JournalSegmentHeader*>(data_);
+	}
+
+	/// @brief Reads the next record, returns false at the end of the segment or
+	/// at a record that was not completely written before a crash.
+	bool next(journal_entry& entry);
+
+private:
+	int fd_{-1};
+	const char* data_{nullptr};
+	size_t size_{0};
+	size_t offset_{0};
+};
+
+/// @brief Checksum stored in every record (FNV-1a over everything but the size).
+uint32_t journal_checksum(const JournalRecord& record, const char* client_id, const char* message);
+
+/// @brief Returns the segment files of a journal directory sorted by writer and segment number.
+std::vector<std::string> list_journal_segments(const std::string& directory);
+
+#endif // JOURNAL_H
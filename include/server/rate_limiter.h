@@ -0,0 +1,66 @@
+/**
+* @file rate_limiter.h
+* @brief Token buckets used to pace how fast sessions are served.
+*
+* A session owns one bucket for itself and shares one bucket with every
+* other session logged in under the same client_id. When a bucket runs
+* into debt the session stops reading until it has refilled, so the
+* traffic is delayed and never dropped.
+*/
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class token_bucket
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	/// @param rate Bytes added to the bucket every second, 0 disables the bucket
+	/// @param burst Maximum amount of bytes the bucket can hold
+	token_bucket(double rate, double burst);
+
+	/// @brief Takes the bytes out of the bucket, the bucket is allowed
+	/// to go negative so a frame is never split or rejected.
+	void consume(size_t bytes, clock::time_point now = clock::now());
+
+	/// @brief Returns how long the owner has to wait until the bucket
+	/// is out of debt, zero when it can proceed right away.
+	clock::duration delay(clock::time_point now = clock::now());
+
+	bool enabled() const { return rate_ > 0; }
+
+private:
+	std::mutex mutex_;
+	double rate_;
+	double burst_;
+	double tokens_;
+	clock::time_point last_refill_;
+
+	void refill(clock::time_point now);
+};
+
+class rate_limiter
+{
+public:
+	rate_limiter(double user_rate, double user_burst);
+
+	/// @brief Returns the bucket shared by all the sessions of a client,
+	/// nullptr when per-user limiting is disabled.
+	std::shared_ptr<token_bucket> user_bucket(const std::string& client_id);
+
+private:
+	std::mutex mutex_;
+	double user_rate_;
+	double user_burst_;
+	size_t sweep_threshold_{64};
+	std::unordered_map<std::string, std::weak_ptr<token_bucket>> users_;
+};
+
+#endif // RATE_LIMITER_H
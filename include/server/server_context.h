@@ -0,0 +1,92 @@
+/**
+* @file server_context.h
+* @brief Configuration and state shared by all the sessions of a server.
+*
+* The session_manager creates one context and every session it accepts
+* keeps a reference to it, so the shared state outlives the manager as
+* long as there are sessions still running.
+*/
+
+#ifndef SERVER_CONTEXT_H
+#define SERVER_CONTEXT_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "server/capture.h"
+#include "server/journal.h"
+#include "server/rate_limiter.h"
+#include "server/session_registry.h"
+#include "utils/types.h"
+
+struct server_options
+{
+	uint16_t port{12345};
+
+	/// Threads running the io_context, every session runs on its own strand
+	size_t threads{1};
+
+	/// Features offered to the clients that negotiate capabilities at login
+	uint32_t features{FEATURE_CHACHA20};
+
+	/// Print every login and every echoed message to stdout
+	bool log_traffic{true};
+
+	/// How many frames a session handles in one scheduling turn before it
+	/// yields the io_context to the other sessions, 0 means no limit
+	size_t frames_per_turn{16};
+
+	/// How many bytes a session handles in one scheduling turn, 0 means no limit
+	size_t bytes_per_turn{4 * 1024};
+
+	/// Token bucket of every session in bytes per second, 0 disables it
+	double session_rate{0};
+	double session_burst{64 * 1024};
+
+	/// Token bucket shared by the sessions with the same client_id, 0 disables it
+	double user_rate{0};
+	double user_burst{64 * 1024};
+
+	/// Directory of the journal of echoed messages, empty disables journaling
+	std::string journal_dir;
+	size_t journal_segment_size{64 * 1024 * 1024};
+	size_t journal_buffer_size{4 * 1024 * 1024};
+	std::chrono::milliseconds journal_fsync_interval{100};
+
+	/// File every frame read or written is recorded to, empty disables the capture
+	std::string capture_file;
+};
+
+struct server_context
+{
+	explicit server_context(const server_options& opts)
+		: options(opts)
+		, limiter(opts.user_rate, opts.user_burst)
+	{
+		if(!options.journal_dir.empty())
+		{
+			journal_options journal_opts;
+			journal_opts.directory = options.journal_dir;
+			journal_opts.segment_size = options.journal_segment_size;
+			journal_opts.buffer_size = options.journal_buffer_size;
+			journal_opts.fsync_interval = options.journal_fsync_interval;
+			journal_opts.writers = options.threads;
+			echo_journal = std::make_unique<journal>(journal_opts);
+		}
+		if(!options.capture_file.empty())
+		{
+			capture = std::make_unique<capture_writer>(options.capture_file);
+		}
+	}
+
+	const server_options options;
+	rate_limiter limiter;
+	session_registry registry;
+	std::unique_ptr<journal> echo_journal;
+	std::unique_ptr<capture_writer> capture;
+};
+
+#endif // SERVER_CONTEXT_H
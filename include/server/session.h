@@ -4,67 +4,199 @@
 *
 * This header contains the session class which define what operations
 * can be handled by the server and what responses to give based
-* on the request received from the clients.
+* on the request received from the clients. The session is written
+* against any Asio stream: the server runs it over TCP sockets and the
+* in-process bench over memory_stream.
 */
 
 #ifndef SESSION_H
 #define SESSION_H
 
 #include <boost/asio.hpp>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <netinet/in.h>
 #include <ostream>
 
+#include "server/server_context.h"
+#include "server/session_handoff.h"
 #include "utils/crypto.hpp"
+#include "utils/trace.hpp"
 #include "utils/types.h"
 
 using boost::asio::ip::tcp;
 
-class session : public std::enable_shared_from_this<session>
+/// What the registry and the broadcasts need from a session, whatever stream it runs on.
+class session_base : public std::enable_shared_from_this<session_base>
 {
 public:
-	session(tcp::socket socket);
+	virtual ~session_base() = default;
+
+	/// @brief Returns the id the session is registered with.
+	virtual uint64_t id() const = 0;
+
+	/// @brief Queues a broadcast for this client, can be called from any thread.
+	/// @param payload The serialized BroadcastMessage body shared with the other recipients
+	virtual void deliver(std::shared_ptr<const std::vector<char>> payload) = 0;
+
+	/// @brief Freezes the session between two frames, releases its socket and calls
+	/// handler with its state. The session stops serving its client, can be called
+	/// from any thread.
+	/// @param write_timeout How long a write in flight may take, past it the write is
+	/// cancelled and the bytes the client didn't get are handed off with the state
+	virtual void hand_off(session_handoff_handler handler, std::chrono::steady_clock::duration write_timeout) = 0;
+};
+
+/// Instantiated for tcp::socket and memory_stream in session.cpp
+template <typename Stream>
+class basic_session : public session_base
+{
+public:
+	basic_session(Stream stream, std::shared_ptr<server_context> context);
+	~basic_session();
 	
 	/// @brief Starts the state machine of the server
 	void start();
 
+	/// @brief Starts from the state another server handed off instead of waiting
+	/// for a login, the buffered frames are handled and the responses sent first.
+	void resume(session_handoff state);
+
+	uint64_t id() const override { return id_; }
+
+	void deliver(std::shared_ptr<const std::vector<char>> payload) override;
+
+	/// Only sessions running over a tcp::socket can be handed off, the others
+	/// report that they ended.
+	void hand_off(session_handoff_handler handler, std::chrono::steady_clock::duration write_timeout) override;
+
 private:
-	tcp::socket socket_;
+	struct broadcast_item
+	{
+		PacketHeader header;
+		std::shared_ptr<const std::vector<char>> payload;
+	};
+
+	Stream stream_;
+	std::shared_ptr<server_context> context_;
+	boost::asio::steady_timer throttle_timer_;
+	std::vector<char> read_buffer_;
+	size_t read_begin_{0};
+	size_t read_end_{0};
+	std::vector<char> write_buffer_;
+	std::vector<char> writing_buffer_;
+	std::deque<broadcast_item> broadcasts_;
+	std::vector<broadcast_item> writing_broadcasts_;
+	std::vector<boost::asio::const_buffer> write_buffers_;
+
+	// Bytes at the front of write_buffer_ that a handed off write already captured
+	size_t captured_prefix_{0};
+	bool reading_{false};
+	bool writing_{false};
+	bool flush_waiting_{false};
+	session_handoff_handler handoff_;
+	bool handed_off_{false};
 	PacketHeader in_header_;
-	std::vector<char> in_body_;
+	const char* in_body_{nullptr};
+	size_t in_body_size_{0};
+	size_t turn_frames_{0};
+	size_t turn_bytes_{0};
+	token_bucket session_bucket_;
+	std::shared_ptr<token_bucket> user_bucket_;
 	std::string client_id;
+	uint64_t id_{0};
+	bool logged_in_{false};
 	uint8_t username_sum_{0};
 	uint8_t password_sum_{0};
+	uint8_t broadcast_seq_{0};
+	uint32_t features_{0};
+	chacha20_key chacha_key_{};
+	size_t dropped_broadcasts_{0};
+#ifdef ECHO_TRACING
+	uint64_t read_started_{0};
+	uint64_t write_started_{0};
+#endif
 
 	static constexpr size_t max_length = 512;
+	static constexpr size_t read_buffer_size = 4 * 1024;
+	static constexpr size_t max_broadcast_backlog = 1024;
+	static constexpr size_t max_broadcasts_per_write = 32;
 
-	/// @brief Reads from the socket the length of the header and if no error is caught
-	/// transalte form network to host and proceed in reading the body.
+	/// @brief Parses the next header from the read buffer, if it is not buffered
+	/// yet read more from the stream first. Transalte form network to host and
+	/// proceed in reading the body.
 	void do_read_header();
 
-	/// @brief Reads from the socket the size of the payload and ensures the server handles it.
+	/// @brief Waits until the whole frame is buffered and ensures the server handles it.
 	void do_read_body();
 
+	/// @brief Reads whatever the client already sent into the free space of the
+	/// read buffer and starts a new turn. The queued responses are sent first so
+	/// the client is never kept waiting on them.
+	void do_read_more();
+
+	/// @brief Accounts the handled frame against the turn and the token buckets
+	/// and either continues with the next frame or ends the turn.
+	void next_frame(size_t frame_size);
+
+	/// @brief Gives the io_context back to the other sessions. The pending responses
+	/// are sent first and if a token bucket is in debt the next turn is delayed.
+	void end_turn();
+
+	/// @brief Resets the per turn counters and continues reading frames once
+	/// the token buckets allow it.
+	void start_turn();
+
+	/// @brief Returns how long the session has to wait for its token buckets.
+	token_bucket::clock::duration throttle_delay();
+
 	/// @brief Decides how to process the packet data based on it's type.
 	void handle_packet();
 
 	/// @brief Since all credentials are accepted we just compute the checksums
-	///  and send back a confirmation packet to tell the client that he logged in.
+	///  and queue a confirmation packet to tell the client that he logged in.
+	///  If the client sent its capabilities the features both ends support are
+	///  enabled and sent back with the confirmation.
 	void handle_login();
 
 	/// @brief Based on the provided LCG variant compute the key to decrypt the cipher
-	/// received from the client and send it back to the client (echo).
+	/// received from the client and queue it back to the client (echo).
 	void handle_echo();
 
-	/// @brief Method that sends a response to the client and ensures our server goes
-	/// in the state to read a new packet.
-	/// @param buffer A buffer_T type owned pointer that accepts different buffers
-	/// @param length A size_t variable that tells how much to write to the socket
-	template <typename buffer_T>
-	void send_packet(std::shared_ptr<buffer_T> buffer, size_t length);
+	/// @brief Decrypts the message once and hands the same plain text to every
+	/// logged in session.
+	void handle_broadcast();
+
+	/// @brief Validates the ciphered payload of the current packet and decrypts it
+	/// with the cipher negotiated at login.
+	/// @param plain_text Receives the decrypted message
+	/// @return false when the packet is malformed
+	bool decrypt_payload(std::vector<uint8_t>& plain_text);
+
+	/// @brief Appends a response to the ones that will be sent at the end of the turn.
+	void queue_packet(const void* data, size_t length);
+
+	/// @brief Records the frames that are about to be written to the capture file.
+	void capture_writes();
+
+	/// @brief Sends the queued responses together with the pending broadcasts in a
+	/// single gathered write, if no other write is in progress.
+	void send_packets();
+
+	/// @brief Moves what a write cancelled by the handoff didn't send in front of
+	/// write_buffer_, so it travels with the state.
+	/// @param written Bytes the cancelled write did send
+	void keep_unsent(size_t written);
+
+	/// @brief Once no read or write is in flight releases the socket and passes
+	/// the state of the session to the handoff handler.
+	void complete_handoff();
 };
 
+using session = basic_session<tcp::socket>;
+
 #endif // SESSION_H
\ No newline at end of file
@@ -0,0 +1,50 @@
+/**
+* @file session_handoff.h
+* @brief State of a session moved to another server process.
+*
+* A session is frozen between two frames, so everything it knows about
+* its client fits here: the login state, the cipher keys, the bytes it
+* read but didn't handle yet and the bytes it didn't send yet. The socket
+* itself travels separately as a file descriptor.
+*/
+
+#ifndef SESSION_HANDOFF_H
+#define SESSION_HANDOFF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "utils/chacha20.hpp"
+
+struct session_handoff
+{
+	/// Socket of the client, -1 when the session ended before it could be handed off
+	int fd{-1};
+
+	std::string client_id;
+	bool logged_in{false};
+	uint8_t username_sum{0};
+	uint8_t password_sum{0};
+	uint8_t broadcast_seq{0};
+	uint32_t features{0};
+	chacha20_key chacha_key{};
+
+	/// Read from the client but not handled yet, starts at a frame boundary
+	std::vector<char> input;
+
+	/// Queued for the client but not written yet. It starts in the middle of a
+	/// frame when a write stuck on a client that stopped reading was cancelled.
+	std::vector<char> output;
+
+	/// Bytes at the start of output left from that cancelled write, the old
+	/// server already recorded them in its capture
+	size_t captured_size{0};
+};
+
+/// Called once with the frozen state, on the strand of the session.
+using session_handoff_handler = std::function<void(session_handoff)>;
+
+#endif // SESSION_HANDOFF_H
@@ -16,10 +16,50 @@ using boost::asio::ip::tcp;
 class session_manager
 {
 public:
-	session_manager(boost::asio::io_context& io_context);
+	session_manager(boost::asio::io_context& io_context, const server_options& options = {});
+
+	/// @brief Accepts on a listening socket another server handed off, the context
+	/// is built by the caller so it can fail before the other server lets go.
+	session_manager(boost::asio::io_context& io_context,
+					std::shared_ptr<server_context> context,
+					tcp::acceptor::native_handle_type listener);
+
+	/// @brief Returns the port the server listens on, useful when it was started on port 0.
+	uint16_t port() const;
+
+	/// @brief Returns the sessions connected to the server.
+	session_registry& registry() { return context_->registry; }
+
+	/// @brief Returns the state shared by the sessions of the server.
+	server_context& context() { return *context_; }
+
+	/// @brief Returns the io_context the sessions run on.
+	boost::asio::io_context& io_context() { return io_context_; }
+
+	/// @brief Stops accepting and gives up the listening socket, the caller owns it.
+	/// Blocks until the acceptor's strand ran it, so it must not be called from
+	/// an io_context thread.
+	tcp::acceptor::native_handle_type release_listener();
+
+	/// @brief Accepts again on the listening socket release_listener gave up, when
+	/// the handoff failed. Takes ownership of listener.
+	void restore_listener(tcp::acceptor::native_handle_type listener);
+
+	/// @brief Asks every session to hand itself off, handler is called once per session
+	/// from the session's strand.
+	/// @param write_timeout How long a session may wait for its write in flight, see session_base::hand_off
+	/// @return How many times handler will be called
+	size_t hand_off_sessions(const session_handoff_handler& handler, std::chrono::steady_clock::duration write_timeout);
+
+	/// @brief Serves a client socket another server handed off, starting from its state.
+	/// The session resumes on its strand, nothing is read or written before the io_context runs.
+	/// @return false if the socket can't be used, it is closed
+	bool adopt_session(session_handoff state);
 
 private:
+	boost::asio::io_context& io_context_;
 	tcp::acceptor acceptor_;
+	std::shared_ptr<server_context> context_;
 
 	/**
 	* @brief Waits for new client connections
@@ -0,0 +1,103 @@
+/**
+* @file session_registry.h
+* @brief Keeps track of the sessions connected to the server.
+*
+* Sessions are indexed by their id and, once they logged in, by their
+* client_id. Both indexes are split in shards with their own lock so
+* sessions running on different io_context threads rarely contend.
+*/
+
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class session_base;
+
+class session_registry
+{
+public:
+	static constexpr size_t shard_count = 16;
+
+	/// @brief Registers a session and returns the id it is known by.
+	uint64_t add(std::weak_ptr<session_base> s);
+
+	/// @brief Forgets the session with the given id.
+	void remove(uint64_t id);
+
+	/// @brief Makes the session reachable by the client_id it logged in with.
+	void bind_client(uint64_t id, const std::string& client_id);
+
+	/// @brief Removes the session from the sessions of a client_id.
+	void unbind_client(uint64_t id, const std::string& client_id);
+
+	/// @brief Returns the session with the given id, nullptr if it is gone.
+	std::shared_ptr<session_base> find(uint64_t id) const;
+
+	/// @brief Returns all the live sessions logged in with a client_id.
+	std::vector<std::shared_ptr<session_base>> find_client(const std::string& client_id) const;
+
+	/// @brief Returns how many sessions are registered.
+	size_t size() const;
+
+	/// @brief Calls f for every live session. The sessions of a shard are
+	/// collected under its lock and f runs after it is released, so f may call
+	/// back into the registry and the last reference to a session may be
+	/// dropped in the loop.
+	template <typename F>
+	void for_each(F&& f) const
+	{
+		std::vector<std::shared_ptr<session_base>> live;
+		for(const id_shard& shard : id_shards_)
+		{
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				live.reserve(shard.sessions.size());
+				for(const auto& entry : shard.sessions)
+				{
+					if(auto s = entry.second.lock())
+					{
+						live.push_back(std::move(s));
+					}
+				}
+			}
+
+			for(const auto& s : live)
+			{
+				f(s);
+			}
+			live.clear();
+		}
+	}
+
+private:
+	struct id_shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_map<uint64_t, std::weak_ptr<session_base>> sessions;
+	};
+
+	struct client_shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_multimap<std::string, uint64_t> clients;
+	};
+
+	std::atomic<uint64_t> next_id_{1};
+	std::array<id_shard, shard_count> id_shards_;
+	std::array<client_shard, shard_count> client_shards_;
+
+	id_shard& shard_for(uint64_t id) { return id_shards_[id % shard_count]; }
+	const id_shard& shard_for(uint64_t id) const { return id_shards_[id % shard_count]; }
+	client_shard& shard_for(const std::string& client_id);
+	const client_shard& shard_for(const std::string& client_id) const;
+};
+
+#endif // SESSION_REGISTRY_H
@@ -0,0 +1,30 @@
+/**
+* @file alloc_counter.hpp
+* @brief Counts every allocation made through the global operator new.
+*
+* The counting operator new lives in src/utils/alloc_counter.cpp, only the
+* executables that link the alloc_counter object library replace the
+* standard one. Elsewhere the functions below are simply not defined.
+*/
+
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+#include <cstdint>
+
+struct alloc_stats
+{
+	uint64_t allocations{0};
+	uint64_t bytes{0};
+
+	alloc_stats operator-(const alloc_stats& other) const
+	{
+		return {allocations - other.allocations, bytes - other.bytes};
+	}
+};
+
+/// @brief Returns how many allocations, and how many bytes, all the threads
+/// made since the process started.
+alloc_stats alloc_snapshot();
+
+#endif // ALLOC_COUNTER_HPP
@@ -0,0 +1,332 @@
+/**
+* @file chacha20.hpp
+* @brief Self contained ChaCha20 keystream (RFC 7539) used as a faster
+* replacement for the LCG when both ends negotiated it at login.
+*
+* The keystream is generated one 64 byte block at a time by the scalar
+* kernel, 4 blocks at a time with SSE2 and 8 blocks at a time with AVX2.
+* The AVX2 kernel is picked at runtime so the binary still runs on CPUs
+* without it.
+*/
+
+#ifndef CHACHA20_HPP
+#define CHACHA20_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA20_X86 1
+#endif
+
+struct chacha20_key
+{
+	uint32_t words[8];
+};
+
+enum class chacha20_kernel
+{
+	scalar,
+	sse2,
+	avx2,
+	best
+};
+
+namespace chacha20_detail
+{
+
+inline uint32_t rotl(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+/// @brief Fills the initial state: constants, key, block counter and nonce.
+inline void init_state(uint32_t state[16],
+					   const chacha20_key& key,
+					   uint32_t counter,
+					   const uint32_t nonce[3])
+{
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	std::memcpy(state + 4, key.words, sizeof(key.words));
+	state[12] = counter;
+	state[13] = nonce[0];
+	state[14] = nonce[1];
+	state[15] = nonce[2];
+}
+
+#define CHACHA20_QUARTER_ROUND(a, b, c, d)                                                         \
+	a += b; d ^= a; d = rotl(d, 16);                                                               \
+	c += d; b ^= c; b = rotl(b, 12);                                                               \
+	a += b; d ^= a; d = rotl(d, 8);                                                                \
+	c += d; b ^= c; b = rotl(b, 7);
+
+/// @brief Writes one 64 byte keystream block.
+inline void block_scalar(const uint32_t state[16], uint8_t* out)
+{
+	uint32_t x[16];
+	std::memcpy(x, state, sizeof(x));
+
+	for(int i = 0; i < 10; ++i)
+	{
+		CHACHA20_QUARTER_ROUND(x[0], x[4], x[8], x[12])
+		CHACHA20_QUARTER_ROUND(x[1], x[5], x[9], x[13])
+		CHACHA20_QUARTER_ROUND(x[2], x[6], x[10], x[14])
+		CHACHA20_QUARTER_ROUND(x[3], x[7], x[11], x[15])
+		CHACHA20_QUARTER_ROUND(x[0], x[5], x[10], x[15])
+		CHACHA20_QUARTER_ROUND(x[1], x[6], x[11], x[12])
+		CHACHA20_QUARTER_ROUND(x[2], x[7], x[8], x[13])
+		CHACHA20_QUARTER_ROUND(x[3], x[4], x[9], x[14])
+	}
+
+	for(int i = 0; i < 16; ++i)
+	{
+		uint32_t word = x[i] + state[i];
+		out[4 * i + 0] = static_cast<uint8_t>(word);
+		out[4 * i + 1] = static_cast<uint8_t>(word >> 8);
+		out[4 * i + 2] = static_cast<uint8_t>(word >> 16);
+		out[4 * i + 3] = static_cast<uint8_t>(word >> 24);
+	}
+}
+
+#undef CHACHA20_QUARTER_ROUND
+
+#ifdef CHACHA20_X86
+
+// The vector kernels keep the same word of every block in one register, so a
+// quarter round works on all the blocks at once and the result only has to be
+// transposed back into block order at the end.
+
+#define CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, a, b, c, d)              \
+	a = add(a, b); d = xor_(d, a); d = rot16(d);                                                   \
+	c = add(c, d); b = xor_(b, c); b = rot12(b);                                                   \
+	a = add(a, b); d = xor_(d, a); d = rot8(d);                                                    \
+	c = add(c, d); b = xor_(b, c); b = rot7(b);
+
+#define CHACHA20_VECTOR_DOUBLE_ROUND(add, xor_, rot16, rot12, rot8, rot7, x)                         \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[0], x[4], x[8], x[12])      \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[1], x[5], x[9], x[13])      \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[2], x[6], x[10], x[14])     \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[3], x[7], x[11], x[15])     \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[0], x[5], x[10], x[15])     \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[1], x[6], x[11], x[12])     \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[2], x[7], x[8], x[13])      \
+	CHACHA20_VECTOR_QUARTER_ROUND(add, xor_, rot16, rot12, rot8, rot7, x[3], x[4], x[9], x[14])
+
+__attribute__((target("sse2"))) inline __m128i sse2_rotl16(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+__attribute__((target("sse2"))) inline __m128i sse2_rotl12(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi32(v, 12), _mm_srli_epi32(v, 20));
+}
+__attribute__((target("sse2"))) inline __m128i sse2_rotl8(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi32(v, 8), _mm_srli_epi32(v, 24));
+}
+__attribute__((target("sse2"))) inline __m128i sse2_rotl7(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi32(v, 7), _mm_srli_epi32(v, 25));
+}
+
+/// @brief Writes 4 consecutive keystream blocks (256 bytes).
+__attribute__((target("sse2"))) inline void blocks4_sse2(const uint32_t state[16], uint8_t* out)
+{
+	__m128i x[16];
+	__m128i orig[16];
+	for(int i = 0; i < 16; ++i)
+	{
+		x[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+	}
+	x[12] = _mm_add_epi32(x[12], _mm_set_epi32(3, 2, 1, 0));
+	for(int i = 0; i < 16; ++i)
+	{
+		orig[i] = x[i];
+	}
+
+	for(int i = 0; i < 10; ++i)
+	{
+		CHACHA20_VECTOR_DOUBLE_ROUND(
+			_mm_add_epi32, _mm_xor_si128, sse2_rotl16, sse2_rotl12, sse2_rotl8, sse2_rotl7, x)
+	}
+
+	for(int g = 0; g < 4; ++g)
+	{
+		__m128i a = _mm_add_epi32(x[4 * g + 0], orig[4 * g + 0]);
+		__m128i b = _mm_add_epi32(x[4 * g + 1], orig[4 * g + 1]);
+		__m128i c = _mm_add_epi32(x[4 * g + 2], orig[4 * g + 2]);
+		__m128i d = _mm_add_epi32(x[4 * g + 3], orig[4 * g + 3]);
+
+		__m128i ab_lo = _mm_unpacklo_epi32(a, b);
+		__m128i cd_lo = _mm_unpacklo_epi32(c, d);
+		__m128i ab_hi = _mm_unpackhi_epi32(a, b);
+		__m128i cd_hi = _mm_unpackhi_epi32(c, d);
+
+		__m128i* dst = reinterpret_cast<__m128i*>(out + 16 * g);
+		_mm_storeu_si128(dst + 0, _mm_unpacklo_epi64(ab_lo, cd_lo));
+		_mm_storeu_si128(dst + 4, _mm_unpackhi_epi64(ab_lo, cd_lo));
+		_mm_storeu_si128(dst + 8, _mm_unpacklo_epi64(ab_hi, cd_hi));
+		_mm_storeu_si128(dst + 12, _mm_unpackhi_epi64(ab_hi, cd_hi));
+	}
+}
+
+__attribute__((target("avx2"))) inline __m256i avx2_rotl16(__m256i v)
+{
+	const __m256i mask = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+										  2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	return _mm256_shuffle_epi8(v, mask);
+}
+__attribute__((target("avx2"))) inline __m256i avx2_rotl12(__m256i v)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(v, 12), _mm256_srli_epi32(v, 20));
+}
+__attribute__((target("avx2"))) inline __m256i avx2_rotl8(__m256i v)
+{
+	const __m256i mask = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+										  3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+	return _mm256_shuffle_epi8(v, mask);
+}
+__attribute__((target("avx2"))) inline __m256i avx2_rotl7(__m256i v)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(v, 7), _mm256_srli_epi32(v, 25));
+}
+
+/// @brief Writes 8 consecutive keystream blocks (512 bytes).
+__attribute__((target("avx2"))) inline void blocks8_avx2(const uint32_t state[16], uint8_t* out)
+{
+	__m256i x[16];
+	__m256i orig[16];
+	for(int i = 0; i < 16; ++i)
+	{
+		x[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+	}
+	x[12] = _mm256_add_epi32(x[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	for(int i = 0; i < 16; ++i)
+	{
+		orig[i] = x[i];
+	}
+
+	for(int i = 0; i < 10; ++i)
+	{
+		CHACHA20_VECTOR_DOUBLE_ROUND(_mm256_add_epi32,
+									 _mm256_xor_si256,
+									 avx2_rotl16,
+									 avx2_rotl12,
+									 avx2_rotl8,
+									 avx2_rotl7,
+									 x)
+	}
+
+	// Unpack works inside each 128 bit lane, so the low lane ends up with
+	// blocks 0-3 and the high lane with blocks 4-7
+	for(int g = 0; g < 4; ++g)
+	{
+		__m256i a = _mm256_add_epi32(x[4 * g + 0], orig[4 * g + 0]);
+		__m256i b = _mm256_add_epi32(x[4 * g + 1], orig[4 * g + 1]);
+		__m256i c = _mm256_add_epi32(x[4 * g + 2], orig[4 * g + 2]);
+		__m256i d = _mm256_add_epi32(x[4 * g + 3], orig[4 * g + 3]);
+
+		__m256i ab_lo = _mm256_unpacklo_epi32(a, b);
+		__m256i cd_lo = _mm256_unpacklo_epi32(c, d);
+		__m256i ab_hi = _mm256_unpackhi_epi32(a, b);
+		__m256i cd_hi = _mm256_unpackhi_epi32(c, d);
+
+		__m256i blocks[4] = {_mm256_unpacklo_epi64(ab_lo, cd_lo),
+							 _mm256_unpackhi_epi64(ab_lo, cd_lo),
+							 _mm256_unpacklo_epi64(ab_hi, cd_hi),
+							 _mm256_unpackhi_epi64(ab_hi, cd_hi)};
+
+		for(int n = 0; n < 4; ++n)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 64 * n + 16 * g),
+							 _mm256_castsi256_si128(blocks[n]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 64 * (n + 4) + 16 * g),
+							 _mm256_extracti128_si256(blocks[n], 1));
+		}
+	}
+}
+
+#undef CHACHA20_VECTOR_DOUBLE_ROUND
+#undef CHACHA20_VECTOR_QUARTER_ROUND
+
+inline bool cpu_has_avx2()
+{
+	static const bool has_avx2 = __builtin_cpu_supports("avx2");
+	return has_avx2;
+}
+
+#endif // CHACHA20_X86
+
+} // namespace chacha20_detail
+
+/// @brief Returns the kernel chacha20_xor uses when asked for the best one.
+inline chacha20_kernel chacha20_best_kernel()
+{
+#ifdef CHACHA20_X86
+	return chacha20_detail::cpu_has_avx2() ? chacha20_kernel::avx2 : chacha20_kernel::sse2;
+#else
+	return chacha20_kernel::scalar;
+#endif
+}
+
+/// @brief XORs the ChaCha20 keystream into a buffer, in and out may be the same.
+/// @param key The 256 bit key
+/// @param nonce The 96 bit nonce
+/// @param counter The block counter of the first byte
+/// @param kernel Lets the benchmarks force a kernel, best picks the fastest one
+inline void chacha20_xor(const chacha20_key& key,
+						 const uint32_t nonce[3],
+						 uint32_t counter,
+						 const uint8_t* in,
+						 uint8_t* out,
+						 size_t len,
+						 chacha20_kernel kernel = chacha20_kernel::best)
+{
+	if(kernel == chacha20_kernel::best)
+	{
+		kernel = chacha20_best_kernel();
+	}
+
+	uint32_t state[16];
+	chacha20_detail::init_state(state, key, counter, nonce);
+
+	alignas(32) uint8_t keystream[512];
+	while(len > 0)
+	{
+		size_t generated = 64;
+#ifdef CHACHA20_X86
+		if(kernel == chacha20_kernel::avx2 && len > 256)
+		{
+			chacha20_detail::blocks8_avx2(state, keystream);
+			generated = 512;
+		}
+		else if(kernel != chacha20_kernel::scalar && len > 64)
+		{
+			chacha20_detail::blocks4_sse2(state, keystream);
+			generated = 256;
+		}
+		else
+#endif
+		{
+			chacha20_detail::block_scalar(state, keystream);
+		}
+		state[12] += static_cast<uint32_t>(generated / 64);
+
+		size_t n = std::min(len, generated);
+		for(size_t i = 0; i < n; ++i)
+		{
+			out[i] = in[i] ^ keystream[i];
+		}
+		in += n;
+		out += n;
+		len -= n;
+	}
+}
+
+#endif // CHACHA20_HPP
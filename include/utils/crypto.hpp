@@ -12,11 +12,18 @@
 #include <string>
 #include <vector>
 
+#include "utils/chacha20.hpp"
+
 /// @brief This returns a key based on provided LCG.
 /// @param key This is the initial key or the previous key
 inline uint32_t next_key(uint32_t key)
 {
-	return (key * 1103515245ul + 12345ul) % 0x7FFFFFFFul;
+	// Same as (key * 1103515245 + 12345) % 0x7FFFFFFF, but 2^31 - 1 is a Mersenne
+	// prime so the modulo folds into shifts and adds instead of a division
+	uint64_t x = key * 1103515245ull + 12345ull;
+	x = (x & 0x7FFFFFFFull) + (x >> 31);
+	x = (x & 0x7FFFFFFFull) + (x >> 31);
+	return static_cast<uint32_t>(x >= 0x7FFFFFFFull ? x - 0x7FFFFFFFull : x);
 }
 
 /// @brief Compute the initial key used for the key generator.
@@ -48,9 +55,9 @@ inline uint8_t compute_checksum_cstr(const char* data, size_t max_len)
 /// @brief Applies XOR between the key and the message.
 /// @param payload_len This is the length that we apply xor for
 /// @param key_state This is the latest key generated
-/// @param message This is the string that contains our plain text
+/// @param message This points to at least payload_len bytes of plain text
 inline std::vector<uint8_t>
-xor_operation(uint16_t payload_len, uint32_t key_state, const std::string& message)
+xor_operation(uint16_t payload_len, uint32_t key_state, const char* message)
 {
 	std::vector<uint8_t> cipher(payload_len);
 
@@ -63,6 +70,52 @@ xor_operation(uint16_t payload_len, uint32_t key_state, const std::string& messa
 	return cipher;
 }
 
+/// @brief Applies XOR between the key and the message.
+/// @param payload_len This is the length that we apply xor for
+/// @param key_state This is the latest key generated
+/// @param message This is the string that contains our plain text
+inline std::vector<uint8_t>
+xor_operation(uint16_t payload_len, uint32_t key_state, const std::string& message)
+{
+	return xor_operation(payload_len, key_state, message.data());
+}
+
+/// @brief Derives the ChaCha20 key of a connection from the login checksums
+/// and the nonces both ends exchanged in their LoginCapabilities.
+/// @param username_sum This is the checksum from the username
+/// @param password_sum This is the checksum from the password
+/// @param client_nonce This is the nonce sent by the client
+/// @param server_nonce This is the nonce sent by the server
+inline chacha20_key derive_chacha20_key(uint8_t username_sum,
+										uint8_t password_sum,
+										uint32_t client_nonce,
+										uint32_t server_nonce)
+{
+	// Run the inputs through one ChaCha20 block so every key word depends on all of them
+	chacha20_key seed{{username_sum, password_sum, client_nonce, server_nonce,
+					   0x9E3779B9u, 0x7F4A7C15u, 0xF39CC060u, 0x5CEDC834u}};
+	const uint32_t nonce[3] = {0, 0, 0};
+	uint8_t zero[sizeof(chacha20_key)] = {};
+
+	chacha20_key key;
+	chacha20_xor(seed, nonce, 0, zero, reinterpret_cast<uint8_t*>(key.words), sizeof(zero));
+	return key;
+}
+
+/// @brief Applies the ChaCha20 keystream of a message to it, it is its own inverse.
+/// @param payload_len This is the length that we apply xor for
+/// @param key This is the key negotiated at login
+/// @param msg_seq This is the seq of the packet, it selects the nonce
+/// @param message This points to at least payload_len bytes of plain text
+inline std::vector<uint8_t>
+chacha20_operation(uint16_t payload_len, const chacha20_key& key, uint8_t msg_seq, const char* message)
+{
+	std::vector<uint8_t> cipher(payload_len);
+	const uint32_t nonce[3] = {msg_seq, 0, 0};
+	chacha20_xor(key, nonce, 0, reinterpret_cast<const uint8_t*>(message), cipher.data(), payload_len);
+	return cipher;
+}
+
 inline void print_string_as_hex(const std::string& str)
 {
 	std::cout << std::hex << std::uppercase << std::setfill('0');
@@ -0,0 +1,290 @@
+/**
+* @file memory_stream.hpp
+* @brief In-process duplex stream that models Asio's AsyncReadStream and
+* AsyncWriteStream concepts.
+*
+* Two connected memory_stream objects behave like the two ends of a TCP
+* connection without going through the kernel, which lets session and
+* connection_manager run against each other inside one process. Writes
+* copy into the peer's inbound buffer (or straight into its pending
+* read) and every completion is posted, never invoked inline, just like
+* the socket operations. Unlike a socket a pending read doesn't keep the
+* io_context running, so run() returns once both ends are idle.
+*/
+
+#ifndef MEMORY_STREAM_HPP
+#define MEMORY_STREAM_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class memory_stream
+{
+public:
+	using executor_type = boost::asio::any_io_executor;
+
+	/// @brief Creates two streams connected to each other.
+	static std::pair<memory_stream, memory_stream> make_pair(const executor_type& executor)
+	{
+		auto shared = std::make_shared<shared_state>();
+		return {memory_stream(executor, shared, 0), memory_stream(executor, shared, 1)};
+	}
+
+	memory_stream(memory_stream&&) = default;
+	memory_stream& operator=(memory_stream&&) = default;
+
+	~memory_stream()
+	{
+		if(shared_)
+		{
+			close();
+		}
+	}
+
+	executor_type get_executor() const { return executor_; }
+
+	bool is_open() const
+	{
+		std::lock_guard<std::mutex> lock(shared_->mutex);
+		return !shared_->closed[side_];
+	}
+
+	/// @brief Closes both directions, the peer reads end of file and our own
+	/// pending read is aborted.
+	void close()
+	{
+		std::unique_ptr<pending_read> own;
+		std::unique_ptr<pending_read> peer;
+		{
+			std::lock_guard<std::mutex> lock(shared_->mutex);
+			if(shared_->closed[side_])
+			{
+				return;
+			}
+			shared_->closed[side_] = true;
+			own = std::move(shared_->directions[side_].reader);
+			peer = std::move(shared_->directions[1 - side_].reader);
+		}
+		if(own)
+		{
+			own->complete(boost::asio::error::operation_aborted, 0);
+		}
+		if(peer)
+		{
+			peer->complete(boost::asio::error::eof, 0);
+		}
+	}
+
+	void close(boost::system::error_code& ec)
+	{
+		close();
+		ec = {};
+	}
+
+	template <typename MutableBufferSequence, typename ReadHandler>
+	auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+	{
+		return boost::asio::async_initiate<ReadHandler, void(boost::system::error_code, std::size_t)>(
+			[this](auto&& handler, const MutableBufferSequence& buffers) {
+				start_read(buffers, std::forward<decltype(handler)>(handler));
+			},
+			handler,
+			buffers);
+	}
+
+	template <typename ConstBufferSequence, typename WriteHandler>
+	auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+	{
+		return boost::asio::async_initiate<WriteHandler, void(boost::system::error_code, std::size_t)>(
+			[this](auto&& handler, const ConstBufferSequence& buffers) {
+				start_write(buffers, std::forward<decltype(handler)>(handler));
+			},
+			handler,
+			buffers);
+	}
+
+private:
+	/// A read waiting for the peer to write, the handler type is erased so
+	/// move-only handlers (like the composed operations) can be stored.
+	struct pending_read
+	{
+		boost::asio::mutable_buffer buffer;
+
+		virtual ~pending_read() = default;
+		virtual void complete(boost::system::error_code ec, std::size_t length) = 0;
+	};
+
+	template <typename Handler>
+	struct pending_read_impl : pending_read
+	{
+		Handler handler;
+		executor_type executor;
+
+		pending_read_impl(Handler&& h, executor_type ex)
+			: handler(std::move(h))
+			, executor(std::move(ex))
+		{ }
+
+		void complete(boost::system::error_code ec, std::size_t length) override
+		{
+			post_completion(executor, std::move(handler), ec, length);
+		}
+	};
+
+	struct direction
+	{
+		std::vector<char> data;
+		size_t read_offset{0};
+		std::unique_ptr<pending_read> reader;
+	};
+
+	struct shared_state
+	{
+		std::mutex mutex;
+		direction directions[2]; // indexed by the side that reads
+		bool closed[2]{false, false};
+	};
+
+	executor_type executor_;
+	std::shared_ptr<shared_state> shared_;
+	int side_;
+
+	memory_stream(executor_type executor, std::shared_ptr<shared_state> shared, int side)
+		: executor_(std::move(executor))
+		, shared_(std::move(shared))
+		, side_(side)
+	{ }
+
+	template <typename Handler>
+	static void post_completion(const executor_type& executor,
+								Handler&& handler,
+								boost::system::error_code ec,
+								std::size_t length)
+	{
+		auto handler_executor = boost::asio::get_associated_executor(handler, executor);
+		boost::asio::post(handler_executor,
+						  [handler = std::forward<Handler>(handler), ec, length]() mutable {
+							  handler(ec, length);
+						  });
+	}
+
+	template <typename MutableBufferSequence, typename Handler>
+	void start_read(const MutableBufferSequence& buffers, Handler&& handler)
+	{
+		// Like the sockets, only the first non empty buffer is filled by a read_some
+		boost::asio::mutable_buffer buffer;
+		for(auto it = boost::asio::buffer_sequence_begin(buffers);
+			it != boost::asio::buffer_sequence_end(buffers);
+			++it)
+		{
+			buffer = boost::asio::mutable_buffer(*it);
+			if(buffer.size() != 0)
+			{
+				break;
+			}
+		}
+
+		boost::system::error_code ec;
+		std::size_t length = 0;
+		{
+			std::lock_guard<std::mutex> lock(shared_->mutex);
+			direction& in = shared_->directions[side_];
+			size_t available = in.data.size() - in.read_offset;
+
+			if(shared_->closed[side_])
+			{
+				ec = boost::asio::error::bad_descriptor;
+			}
+			else if(buffer.size() == 0)
+			{
+			}
+			else if(available > 0)
+			{
+				length = std::min(available, buffer.size());
+				std::memcpy(buffer.data(), in.data.data() + in.read_offset, length);
+				in.read_offset += length;
+				if(in.read_offset == in.data.size())
+				{
+					in.data.clear();
+					in.read_offset = 0;
+				}
+			}
+			else if(shared_->closed[1 - side_])
+			{
+				ec = boost::asio::error::eof;
+			}
+			else
+			{
+				auto pending = std::make_unique<pending_read_impl<std::decay_t<Handler>>>(
+					std::forward<Handler>(handler), executor_);
+				pending->buffer = buffer;
+				in.reader = std::move(pending);
+				return;
+			}
+		}
+		post_completion(executor_, std::forward<Handler>(handler), ec, length);
+	}
+
+	template <typename ConstBufferSequence, typename Handler>
+	void start_write(const ConstBufferSequence& buffers, Handler&& handler)
+	{
+		boost::system::error_code ec;
+		std::size_t length = boost::asio::buffer_size(buffers);
+		std::unique_ptr<pending_read> reader;
+		std::size_t delivered = 0;
+		{
+			std::lock_guard<std::mutex> lock(shared_->mutex);
+			direction& out = shared_->directions[1 - side_];
+
+			if(shared_->closed[side_])
+			{
+				ec = boost::asio::error::bad_descriptor;
+				length = 0;
+			}
+			else if(shared_->closed[1 - side_])
+			{
+				ec = boost::asio::error::broken_pipe;
+				length = 0;
+			}
+			else
+			{
+				auto begin = boost::asio::buffer_sequence_begin(buffers);
+				auto end = boost::asio::buffer_sequence_end(buffers);
+
+				// Hand the bytes straight to a waiting read, the rest is buffered
+				if(out.reader)
+				{
+					reader = std::move(out.reader);
+					delivered = boost::asio::buffer_copy(reader->buffer, buffers);
+				}
+
+				size_t skip = delivered;
+				for(auto it = begin; it != end; ++it)
+				{
+					boost::asio::const_buffer b(*it);
+					if(skip >= b.size())
+					{
+						skip -= b.size();
+						continue;
+					}
+					const char* data = static_cast<const char*>(b.data()) + skip;
+					out.data.insert(out.data.end(), data, data + b.size() - skip);
+					skip = 0;
+				}
+			}
+		}
+
+		if(reader)
+		{
+			reader->complete({}, delivered);
+		}
+		post_completion(executor_, std::forward<Handler>(handler), ec, length);
+	}
+};
+
+#endif // MEMORY_STREAM_HPP
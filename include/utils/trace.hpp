@@ -0,0 +1,223 @@
+/**
+* @file trace.hpp
+* @brief Per stage tracing of the sessions, exported as Chrome trace events.
+*
+* Compiled in only when ECHO_TRACING is defined (cmake -DECHO_TRACING=ON),
+* otherwise the TRACE_ macros expand to nothing. Every thread records
+* into its own ring buffer so recording never locks; the timestamps come
+* from rdtsc on x86 and steady_clock elsewhere and are converted to time
+* when exporting. Export once the threads that record are stopped, the
+* file opens in chrome://tracing or Perfetto.
+*/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_RDTSC
+#endif
+
+namespace trace
+{
+
+struct event
+{
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t id;
+};
+
+/// Stages recorded by one thread, the oldest ones are overwritten once it is full.
+struct thread_buffer
+{
+	explicit thread_buffer(uint32_t tid)
+		: tid(tid)
+		, events(capacity)
+	{ }
+
+	static constexpr size_t capacity = 1 << 16;
+
+	uint32_t tid;
+	std::vector<event> events;
+	uint64_t recorded{0};
+};
+
+struct stage_summary
+{
+	uint64_t count{0};
+	double total_ns{0};
+	double max_ns{0};
+};
+
+/// @brief Returns the current timestamp in ticks.
+inline uint64_t now()
+{
+#ifdef TRACE_RDTSC
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+#endif
+}
+
+namespace detail
+{
+
+struct registry
+{
+	std::mutex mutex;
+	std::vector<std::shared_ptr<thread_buffer>> buffers;
+	uint64_t origin_ticks{now()};
+	std::chrono::steady_clock::time_point origin_time{std::chrono::steady_clock::now()};
+};
+
+inline registry& global()
+{
+	static registry r;
+	return r;
+}
+
+inline thread_buffer& local()
+{
+	// Registered once, the registry keeps the buffer after the thread exits
+	thread_local std::shared_ptr<thread_buffer> buffer = [] {
+		registry& r = global();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		auto b = std::make_shared<thread_buffer>(static_cast<uint32_t>(r.buffers.size() + 1));
+		r.buffers.push_back(b);
+		return b;
+	}();
+	return *buffer;
+}
+
+/// @brief Nanoseconds per tick, measured against steady_clock since the first use.
+inline double ns_per_tick()
+{
+#ifdef TRACE_RDTSC
+	registry& r = global();
+	uint64_t ticks = now() - r.origin_ticks;
+	auto elapsed = std::chrono::steady_clock::now() - r.origin_time;
+	return ticks == 0 ? 1.0 : std::chrono::duration<double, std::nano>(elapsed).count() / ticks;
+#else
+	return 1.0;
+#endif
+}
+
+} // namespace detail
+
+/// @brief Records a stage of the session with the given id on the calling thread.
+inline void record(const char* name, uint64_t start, uint64_t end, uint64_t id)
+{
+	thread_buffer& b = detail::local();
+	b.events[b.recorded++ % thread_buffer::capacity] = event{name, start, end, id};
+}
+
+/// Records the stage from its construction to the end of the scope.
+class span
+{
+public:
+	span(const char* name, uint64_t id)
+		: name_(name)
+		, id_(id)
+		, start_(now())
+	{ }
+
+	~span() { record(name_, start_, now(), id_); }
+
+	span(const span&) = delete;
+	span& operator=(const span&) = delete;
+
+private:
+	const char* name_;
+	uint64_t id_;
+	uint64_t start_;
+};
+
+/// @brief Calls f with every recorded event and the thread it was recorded on.
+template <typename F>
+void for_each_event(F&& f)
+{
+	detail::registry& r = detail::global();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for(const auto& b : r.buffers)
+	{
+		uint64_t kept = std::min<uint64_t>(b->recorded, thread_buffer::capacity);
+		for(uint64_t i = b->recorded - kept; i < b->recorded; ++i)
+		{
+			f(b->tid, b->events[i % thread_buffer::capacity]);
+		}
+	}
+}
+
+/// @brief Returns the count, mean and max duration of every stage.
+inline std::map<std::string, stage_summary> summarize()
+{
+	double scale = detail::ns_per_tick();
+	std::map<std::string, stage_summary> stages;
+	for_each_event([&](uint32_t, const event& e) {
+		stage_summary& s = stages[e.name];
+		double ns = (e.end - e.start) * scale;
+		++s.count;
+		s.total_ns += ns;
+		s.max_ns = std::max(s.max_ns, ns);
+	});
+	return stages;
+}
+
+/// @brief Writes the recorded events as Chrome trace-event JSON, returns false
+/// if the file can't be written.
+inline bool write_chrome_trace(const std::string& path)
+{
+	std::ofstream out(path);
+	if(!out)
+	{
+		return false;
+	}
+
+	double us_per_tick = detail::ns_per_tick() / 1000.0;
+	uint64_t origin = UINT64_MAX;
+	for_each_event([&](uint32_t, const event& e) { origin = std::min(origin, e.start); });
+	bool first = true;
+
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	for_each_event([&](uint32_t tid, const event& e) {
+		out << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+			<< ",\"ts\":" << (e.start - origin) * us_per_tick << ",\"dur\":" << (e.end - e.start) * us_per_tick
+			<< ",\"args\":{\"session\":" << e.id << "}}";
+		first = false;
+	});
+	out << "\n]}\n";
+	return static_cast<bool>(out);
+}
+
+} // namespace trace
+
+#ifdef ECHO_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+/// Records the rest of the enclosing scope as a stage
+#define TRACE_SPAN(name, id) trace::span TRACE_CONCAT(trace_span_, __LINE__)(name, id)
+/// Remembers when an asynchronous stage started
+#define TRACE_START(variable) variable = trace::now()
+/// Records an asynchronous stage started with TRACE_START
+#define TRACE_END(name, variable, id) trace::record(name, variable, trace::now(), id)
+#else
+#define TRACE_SPAN(name, id)
+#define TRACE_START(variable)
+#define TRACE_END(name, variable, id)
+#endif
+
+#endif // TRACE_HPP
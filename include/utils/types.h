@@ -24,6 +24,16 @@ struct LoginResponse
 	uint16_t status_code;
 };
 
+// Appended after LoginRequest by clients that support capability negotiation
+// and after LoginResponse by the server when the request had it. Legacy
+// clients neither send nor receive it and keep using the LCG.
+struct LoginCapabilities
+{
+	uint16_t version;
+	uint32_t features;
+	uint32_t nonce;
+};
+
 // I moved the variable payload outside the network packet
 struct EchoRequest
 {
@@ -37,15 +47,47 @@ struct EchoResponse
 	uint16_t msg_size; 
 };
 
+// A broadcast request is ciphered just like an echo request
+struct BroadcastRequest
+{
+	PacketHeader header;
+	uint16_t msg_size;
+};
+
+// The plain text is serialized once and shared by all the recipients,
+// only the header is built for every session
+struct BroadcastMessage
+{
+	PacketHeader header;
+	uint16_t msg_size;
+};
+
 
 #pragma pack(pop)
 
+constexpr uint16_t PROTOCOL_VERSION = 1;
+
+enum FeatureFlags : uint32_t
+{
+	FEATURE_CHACHA20 = 1u << 0
+};
+
+// The feature bits a protocol version defines. Both ends agree on the lower
+// of their versions and only honour the bits of that version, a bit a later
+// version gives another meaning is never taken for the old one.
+constexpr uint32_t protocol_features(uint16_t version)
+{
+	return version >= 1 ? FEATURE_CHACHA20 : 0;
+}
+
 enum MessageType : uint8_t
 {
 	LOGIN_REQUEST = 0,
 	LOGIN_RESPONSE = 1,
 	ECHO_REQUEST = 2,
-	ECHO_RESPONSE = 3
+	ECHO_RESPONSE = 3,
+	BROADCAST_REQUEST = 4,
+	BROADCAST_MESSAGE = 5
 };
 
 #endif // TYPES_H
\ No newline at end of file
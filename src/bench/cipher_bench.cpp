@@ -0,0 +1,190 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#include <boost/program_options.hpp>
+
+#include "utils/crypto.hpp"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+/// @brief The xor_operation as it was before next_key avoided the division,
+/// kept as the baseline the other ciphers are measured against.
+static std::vector<uint8_t> reference_xor_operation(uint16_t payload_len, uint32_t key_state, const char* message)
+{
+	std::vector<uint8_t> cipher(payload_len);
+	for(size_t i = 0; i < payload_len; ++i)
+	{
+		key_state = (key_state * 1103515245ul + 12345ul) % 0x7FFFFFFFul;
+		cipher[i] = static_cast<uint8_t>(static_cast<uint8_t>(message[i]) ^ (key_state % 256));
+	}
+	return cipher;
+}
+
+/// @brief Checks the kernels against RFC 7539 section 2.4.2 and against each other.
+static bool self_test(const std::vector<chacha20_kernel>& kernels)
+{
+	chacha20_key key;
+	for(int i = 0; i < 8; ++i)
+	{
+		key.words[i] = static_cast<uint32_t>(4 * i) | static_cast<uint32_t>(4 * i + 1) << 8 |
+					   static_cast<uint32_t>(4 * i + 2) << 16 | static_cast<uint32_t>(4 * i + 3) << 24;
+	}
+	const uint32_t nonce[3] = {0, 0x4a000000, 0};
+	const std::string plain_text = "Ladies and Gentlemen of the class of '99: If I could offer you only "
+								   "one tip for the future, sunscreen would be it.";
+	const uint8_t expected[] = {
+		0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69,
+		0x81, 0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f,
+		0xae, 0x0b, 0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd,
+		0x62, 0xb3, 0x57, 0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35,
+		0x9f, 0x08, 0x61, 0xd8, 0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e,
+		0x08, 0x8a, 0x22, 0xb6, 0x5e, 0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c,
+		0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36, 0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4,
+		0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42, 0x87, 0x4d};
+
+	bool ok = true;
+	for(chacha20_kernel kernel : kernels)
+	{
+		std::vector<uint8_t> out(plain_text.size());
+		chacha20_xor(key, nonce, 1, reinterpret_cast<const uint8_t*>(plain_text.data()), out.data(),
+					 out.size(), kernel);
+		if(!std::equal(out.begin(), out.end(), std::begin(expected)))
+		{
+			std::cerr << "RFC 7539 test vector failed for kernel " << static_cast<int>(kernel) << "\n";
+			ok = false;
+		}
+	}
+
+	std::vector<uint8_t> zeros(2048, 0);
+	std::vector<uint8_t> reference(zeros.size());
+	std::vector<uint8_t> out(zeros.size());
+	for(size_t len = 0; len <= zeros.size(); len += 7)
+	{
+		chacha20_xor(key, nonce, 3, zeros.data(), reference.data(), len, chacha20_kernel::scalar);
+		for(chacha20_kernel kernel : kernels)
+		{
+			chacha20_xor(key, nonce, 3, zeros.data(), out.data(), len, kernel);
+			if(!std::equal(out.begin(), out.begin() + len, reference.begin()))
+			{
+				std::cerr << "Kernel " << static_cast<int>(kernel) << " differs at length " << len << "\n";
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	std::mt19937 generator(42);
+	std::string message(512, 'm');
+	for(int i = 0; i < 100000; ++i)
+	{
+		uint32_t key_state = generator();
+		if(xor_operation(512, key_state, message) != reference_xor_operation(512, key_state, message.data()))
+		{
+			std::cerr << "xor_operation differs from the reference for key " << key_state << "\n";
+			ok = false;
+			break;
+		}
+	}
+	return ok;
+}
+
+/// @brief Runs the cipher over the message for about the given time and returns MB/s.
+template <typename F>
+static double throughput(size_t message_size, double seconds, F&& cipher)
+{
+	const std::string message(message_size, 'p');
+	size_t bytes = 0;
+	uint8_t sink = 0;
+	auto start = bench_clock::now();
+	auto deadline = start + std::chrono::duration_cast<bench_clock::duration>(
+								std::chrono::duration<double>(seconds));
+	uint8_t seq = 0;
+	while(bench_clock::now() < deadline)
+	{
+		for(int i = 0; i < 64; ++i)
+		{
+			std::vector<uint8_t> out = cipher(message, seq++);
+			sink ^= out[message_size / 2];
+			bytes += message_size;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+	volatile uint8_t keep = sink;
+	(void)keep;
+	return bytes / elapsed / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = 0.3;
+
+	po::options_description desc("Usage: cipher_bench [options]");
+	desc.add_options()
+		("help,h", "Print this message")
+		("seconds", po::value(&seconds)->default_value(seconds), "Time spent on every measurement");
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if(vm.count("help"))
+	{
+		std::cout << desc << "\n";
+		return 0;
+	}
+
+	std::vector<std::pair<const char*, chacha20_kernel>> kernels = {{"chacha20 scalar", chacha20_kernel::scalar}};
+#ifdef CHACHA20_X86
+	kernels.push_back({"chacha20 sse2", chacha20_kernel::sse2});
+	if(chacha20_best_kernel() == chacha20_kernel::avx2)
+	{
+		kernels.push_back({"chacha20 avx2", chacha20_kernel::avx2});
+	}
+#endif
+
+	std::vector<chacha20_kernel> tested;
+	for(auto& kernel : kernels)
+	{
+		tested.push_back(kernel.second);
+	}
+	if(!self_test(tested))
+	{
+		return 1;
+	}
+
+	chacha20_key key = derive_chacha20_key(0x12, 0x34, 1, 2);
+
+	std::cout << "throughput in MB/s\n";
+	std::cout << "message bytes\tLCG (before)\txor_operation";
+	for(auto& kernel : kernels)
+	{
+		std::cout << "\t" << kernel.first;
+	}
+	std::cout << "\n";
+
+	for(size_t size : {16, 64, 256, 506})
+	{
+		std::cout << size;
+		std::cout << "\t\t" << throughput(size, seconds, [](const std::string& m, uint8_t seq) {
+			return reference_xor_operation(m.size(), compute_initial_key(seq, 0x12, 0x34), m.data());
+		});
+		std::cout << "\t\t" << throughput(size, seconds, [](const std::string& m, uint8_t seq) {
+			return xor_operation(m.size(), compute_initial_key(seq, 0x12, 0x34), m);
+		});
+		for(auto& kernel : kernels)
+		{
+			std::cout << "\t\t" << throughput(size, seconds, [&key, &kernel](const std::string& m, uint8_t seq) {
+				std::vector<uint8_t> cipher(m.size());
+				const uint32_t nonce[3] = {seq, 0, 0};
+				chacha20_xor(key, nonce, 0, reinterpret_cast<const uint8_t*>(m.data()), cipher.data(),
+							 m.size(), kernel.second);
+				return cipher;
+			});
+		}
+		std::cout << "\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include "bench/bench_client.hpp"
+#include "server/session_manager.h"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config
+{
+	int clients{8};
+	int requests{2000};
+	int abusers{1};
+	int interval_us{200};
+	int batch{256};
+};
+
+/// @brief Starts a server with the given options, floods it from the abusive clients
+/// and returns the round trip times seen by the well-behaved ones in microseconds.
+static std::vector<double> run_scenario(const bench_config& config, server_options options)
+{
+	options.port = 0;
+	options.log_traffic = false;
+
+	boost::asio::io_context server_context;
+	session_manager manager(server_context, options);
+	std::thread server_thread([&server_context]() { server_context.run(); });
+
+	std::atomic<bool> stop{false};
+	std::vector<std::thread> abusers;
+	for(int i = 0; i < config.abusers; ++i)
+	{
+		abusers.emplace_back([&, i]() {
+			boost::asio::io_context io_context;
+			bench_client client(io_context, manager.port(), "abuser" + std::to_string(i), "pass");
+
+			// Drain the responses on a separate thread so the server never blocks on us
+			std::thread reader([&client]() {
+				std::array<char, 64 * 1024> sink;
+				boost::system::error_code ec;
+				while(!ec)
+				{
+					client.socket().read_some(boost::asio::buffer(sink), ec);
+				}
+			});
+
+			std::vector<char> batch;
+			boost::system::error_code ec;
+			while(!stop && !ec)
+			{
+				batch.clear();
+				for(int j = 0; j < config.batch; ++j)
+				{
+					client.append_echo(batch, "flooding the server as fast as possible");
+				}
+				boost::asio::write(client.socket(), boost::asio::buffer(batch), ec);
+			}
+
+			client.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+			client.socket().close(ec);
+			reader.join();
+		});
+	}
+
+	std::vector<std::vector<double>> latencies(config.clients);
+	std::vector<std::thread> clients;
+	for(int i = 0; i < config.clients; ++i)
+	{
+		clients.emplace_back([&, i]() {
+			boost::asio::io_context io_context;
+			bench_client client(io_context, manager.port(), "client" + std::to_string(i), "pass");
+			latencies[i].reserve(config.requests);
+
+			for(int j = 0; j < config.requests; ++j)
+			{
+				auto start = bench_clock::now();
+				client.echo("hello " + std::to_string(j));
+				auto elapsed = bench_clock::now() - start;
+				latencies[i].push_back(std::chrono::duration<double, std::micro>(elapsed).count());
+				std::this_thread::sleep_for(std::chrono::microseconds(config.interval_us));
+			}
+		});
+	}
+
+	for(auto& t : clients)
+	{
+		t.join();
+	}
+	stop = true;
+	for(auto& t : abusers)
+	{
+		t.join();
+	}
+
+	server_context.stop();
+	server_thread.join();
+
+	std::vector<double> all;
+	for(auto& l : latencies)
+	{
+		all.insert(all.end(), l.begin(), l.end());
+	}
+	return all;
+}
+
+static void report(const char* name, std::vector<double> samples)
+{
+	double p50 = percentile(samples, 50);
+	double p99 = percentile(samples, 99);
+	double p999 = percentile(samples, 99.9);
+	std::cout << name << ": " << samples.size() << " requests, p50 " << p50 << " us, p99 " << p99
+			  << " us, p99.9 " << p999 << " us\n";
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		bench_config config;
+		server_options fair;
+		fair.user_rate = 256 * 1024;
+
+		po::options_description desc("Usage: fairness_bench [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("clients", po::value(&config.clients)->default_value(config.clients), "Well-behaved clients")
+			("requests", po::value(&config.requests)->default_value(config.requests), "Requests per client")
+			("abusers", po::value(&config.abusers)->default_value(config.abusers), "Clients flooding the server")
+			("interval-us", po::value(&config.interval_us)->default_value(config.interval_us),
+			 "Pause between the requests of a well-behaved client")
+			("frames-per-turn", po::value(&fair.frames_per_turn)->default_value(fair.frames_per_turn),
+			 "Frames per turn when scheduling is on")
+			("bytes-per-turn", po::value(&fair.bytes_per_turn)->default_value(fair.bytes_per_turn),
+			 "Bytes per turn when scheduling is on")
+			("user-rate", po::value(&fair.user_rate)->default_value(fair.user_rate),
+			 "Bytes per second for each client_id when scheduling is on");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+
+		server_options unfair;
+		unfair.frames_per_turn = 0;
+		unfair.bytes_per_turn = 0;
+
+		report("scheduling off", run_scenario(config, unfair));
+		report("scheduling on ", run_scenario(config, fair));
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
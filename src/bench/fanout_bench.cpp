@@ -0,0 +1,202 @@
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include "bench/bench_client.hpp"
+#include "server/session_manager.h"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+/// @brief A logged in client that counts the broadcasts it receives.
+struct receiver
+{
+	receiver(boost::asio::io_context& io_context, uint16_t port, int index)
+		: client(io_context, port, "fan" + std::to_string(index), "pass")
+	{ }
+
+	bench_client client;
+	std::array<char, 2048> buffer;
+	size_t buffered{0};
+	size_t received{0};
+};
+
+/// @brief Keeps reading broadcasts and records when each of them arrived.
+static void read_broadcasts(receiver& r, std::vector<bench_clock::time_point>& arrivals)
+{
+	r.client.socket().async_read_some(
+		boost::asio::buffer(r.buffer.data() + r.buffered, r.buffer.size() - r.buffered),
+		[&r, &arrivals](boost::system::error_code ec, std::size_t length) {
+			if(ec)
+			{
+				return;
+			}
+			r.buffered += length;
+
+			size_t offset = 0;
+			while(r.buffered - offset >= sizeof(PacketHeader))
+			{
+				PacketHeader header;
+				std::memcpy(&header, r.buffer.data() + offset, sizeof(PacketHeader));
+				size_t frame_size = ntohs(header.msg_size);
+				if(r.buffered - offset < frame_size)
+				{
+					break;
+				}
+				if(header.msg_type == BROADCAST_MESSAGE)
+				{
+					arrivals.push_back(bench_clock::now());
+					++r.received;
+				}
+				offset += frame_size;
+			}
+
+			std::memmove(r.buffer.data(), r.buffer.data() + offset, r.buffered - offset);
+			r.buffered -= offset;
+			read_broadcasts(r, arrivals);
+		});
+}
+
+/// @brief Runs the server in a child process, the clients and the server
+/// together would not fit in the file descriptor limit of one process.
+static pid_t start_server(size_t threads, uint16_t& port)
+{
+	int fds[2];
+	if(pipe(fds) != 0)
+	{
+		throw std::runtime_error("pipe failed");
+	}
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		close(fds[0]);
+		server_options options;
+		options.port = 0;
+		options.log_traffic = false;
+		options.threads = threads;
+
+		boost::asio::io_context io_context;
+		session_manager manager(io_context, options);
+		uint16_t listening = manager.port();
+		if(write(fds[1], &listening, sizeof(listening)) != sizeof(listening))
+		{
+			_exit(1);
+		}
+		close(fds[1]);
+
+		std::vector<std::thread> workers;
+		for(size_t i = 1; i < threads; ++i)
+		{
+			workers.emplace_back([&io_context]() { io_context.run(); });
+		}
+		io_context.run();
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if(pid < 0 || read(fds[0], &port, sizeof(port)) != sizeof(port))
+	{
+		throw std::runtime_error("failed to start the server");
+	}
+	close(fds[0]);
+	return pid;
+}
+
+int main(int argc, char* argv[])
+{
+	pid_t server_pid = 0;
+	try
+	{
+		int sessions = 10000;
+		int broadcasts = 20;
+		size_t threads = 1;
+		size_t message_size = 256;
+
+		po::options_description desc("Usage: fanout_bench [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("sessions", po::value(&sessions)->default_value(sessions), "Logged in sessions receiving the broadcasts")
+			("broadcasts", po::value(&broadcasts)->default_value(broadcasts), "Broadcasts to send")
+			("threads", po::value(&threads)->default_value(threads), "Threads running the server")
+			("message-size", po::value(&message_size)->default_value(message_size), "Bytes per broadcast");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+
+		uint16_t port = 0;
+		server_pid = start_server(threads, port);
+
+		boost::asio::io_context io_context;
+		std::vector<std::unique_ptr<receiver>> receivers;
+		receivers.reserve(sessions);
+		for(int i = 0; i < sessions; ++i)
+		{
+			receivers.push_back(std::make_unique<receiver>(io_context, port, i));
+		}
+
+		std::vector<bench_clock::time_point> arrivals;
+		arrivals.reserve(static_cast<size_t>(sessions) * broadcasts);
+		for(auto& r : receivers)
+		{
+			read_broadcasts(*r, arrivals);
+		}
+
+		std::vector<double> deliveries;
+		std::vector<double> completions;
+		std::vector<char> frame;
+		const std::string message(message_size, 'x');
+
+		for(int i = 0; i < broadcasts; ++i)
+		{
+			arrivals.clear();
+			frame.clear();
+			receivers[0]->client.append_echo(frame, message, BROADCAST_REQUEST);
+
+			auto start = bench_clock::now();
+			boost::asio::write(receivers[0]->client.socket(), boost::asio::buffer(frame));
+			while(arrivals.size() < receivers.size())
+			{
+				io_context.run_one();
+			}
+
+			for(auto arrival : arrivals)
+			{
+				deliveries.push_back(std::chrono::duration<double, std::micro>(arrival - start).count());
+			}
+			completions.push_back(
+				std::chrono::duration<double, std::micro>(arrivals.back() - start).count());
+		}
+
+		std::cout << "fan-out of " << message_size << " bytes to " << sessions << " sessions, "
+				  << broadcasts << " broadcasts, " << threads << " server threads\n";
+		std::cout << "delivery: p50 " << percentile(deliveries, 50) << " us, p99 "
+				  << percentile(deliveries, 99) << " us\n";
+		std::cout << "last recipient: p50 " << percentile(completions, 50) << " us, max "
+				  << percentile(completions, 100) << " us\n";
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+	}
+
+	if(server_pid > 0)
+	{
+		kill(server_pid, SIGTERM);
+		waitpid(server_pid, nullptr, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include "bench/bench_client.hpp"
+#include "server/handoff.h"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+/// @brief Runs the io_context of a server child until it is stopped, then exits the child.
+[[noreturn]] static void run_server_child(boost::asio::io_context& io_context, size_t threads)
+{
+	std::vector<std::thread> workers;
+	for(size_t i = 1; i < threads; ++i)
+	{
+		workers.emplace_back([&io_context]() { io_context.run(); });
+	}
+	io_context.run();
+	for(auto& t : workers)
+	{
+		t.join();
+	}
+	_exit(0);
+}
+
+/// A server running in a child process. Every process gets its own file
+/// descriptor limit, the clients and two servers would not fit in one.
+struct server_child
+{
+	pid_t pid{0};
+	int go{-1};
+	int result{-1};
+};
+
+/// @brief Forks a server that either listens on a new port or takes over from
+/// the server on the handoff socket. It waits for the go byte first, so it can
+/// be forked before the bench starts its threads. Once running it writes back
+/// the port, or how long the takeover took.
+static server_child fork_server(const std::string& handoff_path, size_t threads, bool takeover)
+{
+	int go[2];
+	int fds[2];
+	if(pipe(go) != 0 || pipe(fds) != 0)
+	{
+		throw std::runtime_error("pipe failed");
+	}
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		close(go[1]);
+		close(fds[0]);
+		char byte;
+		if(read(go[0], &byte, 1) != 1)
+		{
+			_exit(1);
+		}
+		close(go[0]);
+
+		try
+		{
+			server_options options;
+			options.port = 0;
+			options.log_traffic = false;
+			options.threads = threads;
+
+			boost::asio::io_context io_context;
+			auto start = bench_clock::now();
+			handoff_listener handoff(io_context, handoff_path, [&io_context]() { io_context.stop(); }, takeover);
+			std::unique_ptr<session_manager> manager =
+				takeover ? take_over(io_context, std::make_shared<server_context>(options), handoff_path)
+						 : std::make_unique<session_manager>(io_context, options);
+			double reported = takeover
+								  ? std::chrono::duration<double, std::milli>(bench_clock::now() - start).count()
+								  : manager->port();
+
+			handoff.publish();
+			handoff.start(*manager);
+			if(write(fds[1], &reported, sizeof(reported)) != sizeof(reported))
+			{
+				_exit(1);
+			}
+			close(fds[1]);
+			run_server_child(io_context, threads);
+		}
+		catch(std::exception& e)
+		{
+			std::cerr << (takeover ? "New" : "Old") << " server: " << e.what() << "\n";
+			_exit(1);
+		}
+	}
+
+	close(go[0]);
+	close(fds[1]);
+	if(pid < 0)
+	{
+		throw std::runtime_error("fork failed");
+	}
+	return server_child{pid, go[1], fds[0]};
+}
+
+/// @brief Lets the server child run and waits for what it writes back.
+static double start_server(server_child& child)
+{
+	double result = 0;
+	char byte = 1;
+	if(write(child.go, &byte, 1) != 1 || read(child.result, &result, sizeof(result)) != sizeof(result))
+	{
+		throw std::runtime_error("failed to start the server");
+	}
+	close(child.go);
+	close(child.result);
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	server_child old_server;
+	server_child new_server;
+	std::string handoff_path = "/tmp/handoff_bench.sock";
+	int exit_code = 0;
+	try
+	{
+		int sessions = 10000;
+		int probes = 4;
+		size_t threads = 1;
+		size_t message_size = 64;
+
+		po::options_description desc("Usage: handoff_bench [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("sessions", po::value(&sessions)->default_value(sessions), "Logged in sessions to hand off")
+			("probes", po::value(&probes)->default_value(probes), "Clients echoing in a loop to time the stall")
+			("threads", po::value(&threads)->default_value(threads), "Threads running each server")
+			("message-size", po::value(&message_size)->default_value(message_size), "Bytes per message")
+			("socket", po::value(&handoff_path)->default_value(handoff_path), "Unix socket of the handoff");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+
+		old_server = fork_server(handoff_path, threads, false);
+		new_server = fork_server(handoff_path, threads, true);
+		double port = start_server(old_server);
+
+		// Half of the clients negotiate ChaCha20, so both kinds of keys have to survive
+		boost::asio::io_context io_context;
+		std::vector<std::unique_ptr<bench_client>> clients;
+		clients.reserve(sessions);
+		for(int i = 0; i < sessions + probes; ++i)
+		{
+			clients.push_back(std::make_unique<bench_client>(io_context,
+															 static_cast<uint16_t>(port),
+															 "handoff" + std::to_string(i),
+															 "pass",
+															 i % 2 == 0 ? static_cast<uint32_t>(FEATURE_CHACHA20) : 0u));
+		}
+
+		const std::string message(message_size, 'h');
+
+		// The probes keep echoing through the handoff, their slowest round trip is the stall
+		std::atomic<bool> stop{false};
+		std::atomic<int> failures{0};
+		std::vector<std::thread> probe_threads;
+		std::vector<double> stalls(probes);
+		for(int i = 0; i < probes; ++i)
+		{
+			probe_threads.emplace_back([&, i]() {
+				bench_client& probe = *clients[sessions + i];
+				try
+				{
+					while(!stop)
+					{
+						auto start = bench_clock::now();
+						if(probe.echo(message) != message)
+						{
+							++failures;
+						}
+						stalls[i] = std::max(
+							stalls[i], std::chrono::duration<double, std::milli>(bench_clock::now() - start).count());
+					}
+				}
+				catch(std::exception&)
+				{
+					++failures;
+				}
+			});
+		}
+
+		// Every session has a request in flight while it moves
+		std::vector<char> frame;
+		for(int i = 0; i < sessions; ++i)
+		{
+			frame.clear();
+			clients[i]->append_echo(frame, message);
+			boost::asio::write(clients[i]->socket(), boost::asio::buffer(frame));
+		}
+
+		auto start = bench_clock::now();
+		double takeover_ms = start_server(new_server);
+		waitpid(old_server.pid, nullptr, 0);
+		old_server.pid = 0;
+		double total_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+
+		stop = true;
+		for(auto& t : probe_threads)
+		{
+			t.join();
+		}
+
+		// The answer to the request in flight, then a round trip served by the new server
+		for(int i = 0; i < sessions; ++i)
+		{
+			if(clients[i]->read_echo() != message || clients[i]->echo(message) != message)
+			{
+				++failures;
+			}
+		}
+
+		std::cout << "handoff of " << sessions << " sessions, " << threads << " server threads\n";
+		std::cout << "takeover (new server): " << takeover_ms << " ms\n";
+		std::cout << "until the old server exited: " << total_ms << " ms\n";
+		std::cout << "longest probe round trip: " << percentile(stalls, 100) << " ms\n";
+		std::cout << "failed echoes: " << failures << "\n";
+		if(failures != 0)
+		{
+			throw std::runtime_error("requests were lost in the handoff");
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		exit_code = 1;
+	}
+
+	for(server_child* child : {&old_server, &new_server})
+	{
+		if(child->pid > 0)
+		{
+			kill(child->pid, SIGTERM);
+			waitpid(child->pid, nullptr, 0);
+		}
+	}
+	::unlink(handoff_path.c_str());
+	return exit_code;
+}
@@ -0,0 +1,237 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "client/connection_manager.h"
+#include "server/session.h"
+#include "utils/alloc_counter.hpp"
+#include "utils/memory_stream.hpp"
+#include "utils/trace.hpp"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+using client_type = basic_connection_manager<memory_stream>;
+using session_type = basic_session<memory_stream>;
+
+struct bench_config
+{
+	int clients{16};
+	uint64_t requests{200000};
+	int pipeline{8};
+	size_t message_size{64};
+
+	/// Share of the requests that warms up the buffers before measuring
+	double warmup{0.1};
+
+	/// Budgets of the steady state, the bench fails when one is exceeded; 0 disables it
+	double max_allocs{0};
+	double max_ns{0};
+};
+
+/// State of one client, the handlers of the client point back to it.
+struct bench_client_state
+{
+	std::shared_ptr<client_type> client;
+	uint64_t sent{0};
+	uint64_t received{0};
+	uint64_t mismatches{0};
+	uint64_t broadcasts{0};
+	bool logged_in{false};
+};
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		bench_config config;
+
+		po::options_description desc("Usage: inprocess_bench [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("clients", po::value(&config.clients)->default_value(config.clients), "Client and session pairs")
+			("requests", po::value(&config.requests)->default_value(config.requests), "Echo requests per client")
+			("pipeline", po::value(&config.pipeline)->default_value(config.pipeline), "Requests in flight per client")
+			("message-size", po::value(&config.message_size)->default_value(config.message_size), "Bytes per message")
+			("warmup", po::value(&config.warmup)->default_value(config.warmup), "Share of the requests not measured")
+			("max-allocs-per-request", po::value(&config.max_allocs)->default_value(config.max_allocs),
+			 "Fail when a steady state request allocates more, 0 for no budget")
+			("max-ns-per-request", po::value(&config.max_ns)->default_value(config.max_ns),
+			 "Fail when a steady state request takes longer, 0 for no budget")
+			("trace", po::value<std::string>(), "Write the stages of every request as Chrome trace JSON "
+												"(needs a build with -DECHO_TRACING=ON)")
+			("legacy-cipher", "Use the LCG instead of negotiating ChaCha20");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+
+#ifndef ECHO_TRACING
+		if(vm.count("trace"))
+		{
+			std::cerr << "Tracing is not compiled in, configure with -DECHO_TRACING=ON\n";
+			return 1;
+		}
+#endif
+
+		server_options options;
+		options.log_traffic = false;
+		if(vm.count("legacy-cipher"))
+		{
+			options.features = 0;
+		}
+		auto context = std::make_shared<server_context>(options);
+
+		// NUL bytes in the middle make sure nothing treats the payload as a C string
+		std::string message(config.message_size, 'm');
+		for(size_t i = 7; i < message.size(); i += 16)
+		{
+			message[i] = '\0';
+		}
+
+		boost::asio::io_context io_context;
+		std::vector<std::unique_ptr<bench_client_state>> states;
+		int logins = 0;
+
+		// The steady state starts once the warmup requests are answered
+		const uint64_t total = static_cast<uint64_t>(config.clients) * config.requests;
+		const uint64_t warmup = static_cast<uint64_t>(total * config.warmup);
+		uint64_t answered = 0;
+		alloc_stats steady_allocs = alloc_snapshot();
+		auto steady_start = bench_clock::now();
+
+		for(int i = 0; i < config.clients; ++i)
+		{
+			auto streams = memory_stream::make_pair(io_context.get_executor());
+			std::make_shared<session_type>(std::move(streams.first), context)->start();
+
+			states.push_back(std::make_unique<bench_client_state>());
+			bench_client_state* state = states.back().get();
+
+			auto send_next = [state, &config, &message]() {
+				if(state->sent < config.requests)
+				{
+					++state->sent;
+					state->client->send_request(ECHO_REQUEST, message);
+				}
+			};
+
+			client_handlers handlers;
+			handlers.login = [state, &logins, &config, send_next](bool ok) {
+				state->logged_in = ok;
+				++logins;
+				for(int j = 0; ok && j < config.pipeline; ++j)
+				{
+					send_next();
+				}
+			};
+			handlers.echo = [&, state, send_next](const char* data, size_t size) {
+				++state->received;
+				if(++answered == warmup)
+				{
+					steady_allocs = alloc_snapshot();
+					steady_start = bench_clock::now();
+				}
+				if(std::string_view(data, size) != message)
+				{
+					++state->mismatches;
+				}
+				send_next();
+			};
+			handlers.broadcast = [state](const char*, size_t) { ++state->broadcasts; };
+
+			state->client = std::make_shared<client_type>(
+				std::move(streams.second), "inproc" + std::to_string(i), "pass", std::move(handlers));
+			state->client->start();
+		}
+
+		io_context.run();
+
+		auto elapsed = bench_clock::now() - steady_start;
+		alloc_stats allocs = alloc_snapshot() - steady_allocs;
+		uint64_t measured = answered - warmup;
+
+		// Every logged in session has to receive a broadcast exactly once
+		states.front()->client->send_request(BROADCAST_REQUEST, "done");
+		io_context.restart();
+		io_context.run();
+
+		uint64_t received = 0;
+		uint64_t mismatches = 0;
+		int missing_broadcasts = 0;
+		for(const auto& state : states)
+		{
+			received += state->received;
+			mismatches += state->mismatches;
+			if(!state->logged_in || state->broadcasts != 1)
+			{
+				++missing_broadcasts;
+			}
+			state->client->stop();
+		}
+		io_context.restart();
+		io_context.run();
+
+		double ns = std::chrono::duration<double, std::nano>(elapsed).count() / measured;
+		double allocs_per_request = static_cast<double>(allocs.allocations) / measured;
+		std::cout << "clients:          " << config.clients << " (" << logins << " logged in)\n"
+				  << "requests:         " << received << " (" << measured << " measured)\n"
+				  << "ns/request:       " << ns << "\n"
+				  << "requests/s:       " << 1e9 / ns << "\n"
+				  << "allocs/request:   " << allocs_per_request << "\n"
+				  << "bytes/request:    " << static_cast<double>(allocs.bytes) / measured << "\n";
+
+#ifdef ECHO_TRACING
+		// Only the events still in the ring buffers, the latest of the run
+		std::cout << "stage              count     mean ns      max ns\n" << std::fixed << std::setprecision(0);
+		for(const auto& [name, stage] : trace::summarize())
+		{
+			std::cout << std::left << std::setw(14) << name << std::right << std::setw(10) << stage.count
+					  << std::setw(12) << stage.total_ns / stage.count << std::setw(12) << stage.max_ns << "\n";
+		}
+		if(vm.count("trace") && !trace::write_chrome_trace(vm["trace"].as<std::string>()))
+		{
+			std::cerr << "Can't write " << vm["trace"].as<std::string>() << "\n";
+			return 1;
+		}
+#endif
+
+		bool failed = false;
+		if(received != total || mismatches != 0 || missing_broadcasts != 0)
+		{
+			std::cerr << "FAILED: " << received << "/" << total << " echoes, " << mismatches
+					  << " mismatched, " << missing_broadcasts << " clients without the broadcast\n";
+			failed = true;
+		}
+		if(config.max_allocs > 0 && allocs_per_request > config.max_allocs)
+		{
+			std::cerr << "FAILED: " << allocs_per_request << " allocations per request, the budget is "
+					  << config.max_allocs << "\n";
+			failed = true;
+		}
+		if(config.max_ns > 0 && ns > config.max_ns)
+		{
+			std::cerr << "FAILED: " << ns << " ns per request, the budget is " << config.max_ns << "\n";
+			failed = true;
+		}
+		if(failed)
+		{
+			return 1;
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include "bench/bench_client.hpp"
+#include "server/session_manager.h"
+
+namespace po = boost::program_options;
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config
+{
+	int clients{4};
+	int batch{64};
+	double seconds{2};
+	size_t message_size{64};
+};
+
+/// @brief Lets the clients pipeline echo requests as fast as the server
+/// answers them and returns the requests per second.
+static double run_scenario(const bench_config& config, server_options options, uint64_t& journaled)
+{
+	options.port = 0;
+	options.log_traffic = false;
+
+	double rate = 0;
+	{
+		boost::asio::io_context server_context;
+		session_manager manager(server_context, options);
+		std::thread server_thread([&server_context]() { server_context.run(); });
+
+		std::atomic<bool> stop{false};
+		std::atomic<uint64_t> requests{0};
+		std::vector<std::thread> clients;
+		for(int i = 0; i < config.clients; ++i)
+		{
+			clients.emplace_back([&, i]() {
+				boost::asio::io_context io_context;
+				bench_client client(io_context, manager.port(), "journal" + std::to_string(i), "pass");
+				const std::string message(config.message_size, 'j');
+				std::vector<char> batch;
+
+				while(!stop)
+				{
+					batch.clear();
+					for(int j = 0; j < config.batch; ++j)
+					{
+						client.append_echo(batch, message);
+					}
+					boost::asio::write(client.socket(), boost::asio::buffer(batch));
+					for(int j = 0; j < config.batch; ++j)
+					{
+						client.read_echo();
+					}
+					requests += config.batch;
+				}
+			});
+		}
+
+		auto start = bench_clock::now();
+		std::this_thread::sleep_for(std::chrono::duration<double>(config.seconds));
+		stop = true;
+		for(auto& t : clients)
+		{
+			t.join();
+		}
+		double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+		rate = requests / elapsed;
+
+		if(auto& j = manager.context().echo_journal)
+		{
+			journaled = j->records();
+			if(j->dropped() != 0)
+			{
+				std::cout << "  " << j->dropped() << " records dropped\n";
+			}
+		}
+
+		server_context.stop();
+		server_thread.join();
+	}
+	return rate;
+}
+
+/// @brief Returns the directory the journal is written to. Without --dir a fresh one
+/// is made under the temporary directory. An existing --dir may only hold journal
+/// segments, the bench never writes over or deletes anything else.
+static std::string prepare_directory(const std::string& requested, bool& created)
+{
+	namespace fs = std::filesystem;
+	created = false;
+
+	if(requested.empty())
+	{
+		std::string pattern = (fs::temp_directory_path() / "journal_bench-XXXXXX").string();
+		if(::mkdtemp(pattern.data()) == nullptr)
+		{
+			throw std::runtime_error("Failed to create a scratch directory in " + fs::temp_directory_path().string());
+		}
+		created = true;
+		return pattern;
+	}
+
+	if(!fs::exists(requested))
+	{
+		fs::create_directories(requested);
+		created = true;
+		return requested;
+	}
+	if(!fs::is_directory(requested))
+	{
+		throw std::runtime_error(requested + " is not a directory");
+	}
+	for(const auto& file : fs::directory_iterator(requested))
+	{
+		if(!file.is_regular_file() || file.path().extension() != ".journal")
+		{
+			throw std::runtime_error(requested + " holds more than journal segments, pick an empty directory");
+		}
+	}
+	return requested;
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		bench_config config;
+		std::string directory;
+		size_t segment_mb = 16;
+		long fsync_ms = 100;
+
+		po::options_description desc("Usage: journal_bench [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("clients", po::value(&config.clients)->default_value(config.clients), "Clients pipelining requests")
+			("batch", po::value(&config.batch)->default_value(config.batch), "Requests in flight per client")
+			("seconds", po::value(&config.seconds)->default_value(config.seconds), "Duration of each scenario")
+			("message-size", po::value(&config.message_size)->default_value(config.message_size), "Bytes per message")
+			("dir", po::value(&directory), "Directory for the journal, a new one in the temporary directory by default")
+			("segment-mb", po::value(&segment_mb)->default_value(segment_mb), "Journal segment size in MiB")
+			("fsync-ms", po::value(&fsync_ms)->default_value(fsync_ms), "Journal fsync interval, 0 for none")
+			("keep", "Keep the journal to scan it with journal_reader");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+
+		bool created = false;
+		directory = prepare_directory(directory, created);
+		std::vector<std::string> existing = list_journal_segments(directory);
+
+		uint64_t journaled = 0;
+		server_options plain;
+		double without = run_scenario(config, plain, journaled);
+		std::cout << "journal off: " << without << " requests/s\n";
+
+		server_options journaling;
+		journaling.journal_dir = directory;
+		journaling.journal_segment_size = segment_mb << 20;
+		journaling.journal_fsync_interval = std::chrono::milliseconds(fsync_ms);
+		double with = run_scenario(config, journaling, journaled);
+		std::cout << "journal on:  " << with << " requests/s, " << journaled << " records ("
+				  << (1.0 - with / without) * 100.0 << "% slower)\n";
+
+		if(vm.count("keep"))
+		{
+			std::cout << "journal kept in " << directory << "\n";
+		}
+		else
+		{
+			// Only the segments of this run
+			for(const std::string& path : list_journal_segments(directory))
+			{
+				if(std::find(existing.begin(), existing.end(), path) == existing.end())
+				{
+					std::filesystem::remove(path);
+				}
+			}
+			if(created)
+			{
+				std::error_code ec;
+				std::filesystem::remove(directory, ec);
+			}
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
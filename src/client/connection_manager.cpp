@@ -1,26 +1,73 @@
 #include "client/connection_manager.h"
+#include "utils/memory_stream.hpp"
+#include <algorithm>
 #include <cstring>
+#include <random>
+#include <type_traits>
+
+// Declared in the header, defined instead of the primary template for tcp::socket only
+template <>
+basic_connection_manager<tcp::socket>::basic_connection_manager(boost::asio::io_context& io_context,
+																 const std::string& username,
+																 const std::string& password)
+	: resolver_(std::in_place, io_context)
+	, stream_(io_context)
+	, stdin_(std::in_place, io_context, ::dup(STDIN_FILENO))
+	, username_(username)
+	, password_(password)
+	, msg_seq_(0)
+{ }
 
-connection_manager::connection_manager(boost::asio::io_context& io_context,
-									   const std::string& username,
-									   const std::string& password)
-	: resolver_(io_context)
-	, socket_(io_context)
-	, stdin_(io_context, ::dup(STDIN_FILENO))
+template <typename Stream>
+basic_connection_manager<Stream>::basic_connection_manager(Stream stream,
+														   const std::string& username,
+														   const std::string& password,
+														   client_handlers handlers)
+	: stream_(std::move(stream))
+	, handlers_(std::move(handlers))
 	, username_(username)
 	, password_(password)
 	, msg_seq_(0)
 { }
 
-void connection_manager::start()
+template <typename Stream>
+void basic_connection_manager<Stream>::start()
+{
+	if constexpr(std::is_same_v<Stream, tcp::socket>)
+	{
+		if(resolver_)
+		{
+			resolve_connection();
+			return;
+		}
+	}
+	on_connected();
+}
+
+template <>
+void basic_connection_manager<tcp::socket>::establish_connection(const tcp::resolver::results_type& endpoint)
 {
-	resolve_connection();
+	auto self(shared_from_this());
+	boost::asio::async_connect(
+		stream_, endpoint, [this, self](const boost::system::error_code& ec, const tcp::endpoint&) {
+			if(!ec)
+			{
+				std::cout << "Connected to server.\n";
+				on_connected();
+			}
+			else
+			{
+				std::cerr << "Connect error: " << ec.message() << "\n";
+				return;
+			}
+		});
 }
 
-void connection_manager::resolve_connection()
+template <>
+void basic_connection_manager<tcp::socket>::resolve_connection()
 {
 	auto self(shared_from_this());
-	resolver_.async_resolve("127.0.0.1",
+	resolver_->async_resolve("127.0.0.1",
 							"12345",
 							[this, self](const boost::system::error_code& ec,
 										 const tcp::resolver::results_type& endpoint) {
@@ -36,26 +83,15 @@ void connection_manager::resolve_connection()
 							});
 }
 
-void connection_manager::establish_connection(const tcp::resolver::results_type& endpoint)
+template <typename Stream>
+void basic_connection_manager<Stream>::on_connected()
 {
-	auto self(shared_from_this());
-	boost::asio::async_connect(
-		socket_, endpoint, [this, self](const boost::system::error_code& ec, const tcp::endpoint&) {
-			if(!ec)
-			{
-				std::cout << "Connected to server.\n";
-				send_login_request();
-				read_packet_header();
-			}
-			else
-			{
-				std::cerr << "Connect error: " << ec.message() << "\n";
-				return;
-			}
-		});
+	send_login_request();
+	read_packet_header();
 }
 
-void connection_manager::send_login_request()
+template <typename Stream>
+void basic_connection_manager<Stream>::send_login_request()
 {
 	LoginRequest login;
 	login.header.msg_type = LOGIN_REQUEST;
@@ -77,14 +113,24 @@ void connection_manager::send_login_request()
 	username_sum_ = checksum(login.username, sizeof(login.username));
 	password_sum_ = checksum(login.password, sizeof(login.password));
 
-	login.header.msg_size = htons(login.header.msg_size);
+	client_nonce_ = std::random_device{}();
+
+	LoginCapabilities capabilities;
+	capabilities.version = htons(PROTOCOL_VERSION);
+	capabilities.features = htonl(FEATURE_CHACHA20);
+	capabilities.nonce = htonl(client_nonce_);
+
+	login.header.msg_size = htons(login.header.msg_size + sizeof(LoginCapabilities));
 
 	auto buffer = std::make_shared<std::vector<char>>(
 		reinterpret_cast<char*>(&login), reinterpret_cast<char*>(&login) + sizeof(LoginRequest));
+	buffer->insert(buffer->end(),
+				   reinterpret_cast<char*>(&capabilities),
+				   reinterpret_cast<char*>(&capabilities) + sizeof(LoginCapabilities));
 
 	auto self(shared_from_this());
 	boost::asio::async_write(
-		socket_,
+		stream_,
 		boost::asio::buffer(*buffer),
 		[this, self, buffer](const boost::system::error_code& ec, std::size_t) {
 			if(ec)
@@ -95,10 +141,11 @@ void connection_manager::send_login_request()
 		});
 }
 
-void connection_manager::read_packet_header()
+template <typename Stream>
+void basic_connection_manager<Stream>::read_packet_header()
 {
 	auto self(shared_from_this());
-	boost::asio::async_read(socket_,
+	boost::asio::async_read(stream_,
 							boost::asio::buffer(&in_header_, sizeof(PacketHeader)),
 							[this, self](const boost::system::error_code& ec, std::size_t length) {
 								if(!ec && length == sizeof(PacketHeader))
@@ -118,7 +165,8 @@ void connection_manager::read_packet_header()
 							});
 }
 
-void connection_manager::read_packet_body()
+template <typename Stream>
+void basic_connection_manager<Stream>::read_packet_body()
 {
 	auto self(shared_from_this());
 	size_t body_size = in_header_.msg_size - sizeof(PacketHeader);
@@ -131,7 +179,7 @@ void connection_manager::read_packet_body()
 
 	in_body_.resize(body_size);
 
-	boost::asio::async_read(socket_,
+	boost::asio::async_read(stream_,
 							boost::asio::buffer(in_body_),
 							[this, self](const boost::system::error_code& ec, std::size_t length) {
 								if(!ec)
@@ -147,7 +195,8 @@ void connection_manager::read_packet_body()
 							});
 }
 
-void connection_manager::handle_server_packet()
+template <typename Stream>
+void basic_connection_manager<Stream>::handle_server_packet()
 {
 	switch(in_header_.msg_type)
 	{
@@ -157,13 +206,17 @@ void connection_manager::handle_server_packet()
 	case ECHO_RESPONSE:
 		handle_echo_response();
 		break;
+	case BROADCAST_MESSAGE:
+		handle_broadcast_message();
+		break;
 	default:
 		std::cerr << "Unknown message type: " << static_cast<int>(in_header_.msg_type) << "\n";
 		break;
 	}
 }
 
-void connection_manager::handle_login_response()
+template <typename Stream>
+void basic_connection_manager<Stream>::handle_login_response()
 {
 	if(in_body_.size() < sizeof(LoginResponse) - sizeof(PacketHeader))
 	{
@@ -175,6 +228,29 @@ void connection_manager::handle_login_response()
 		(static_cast<uint16_t>(static_cast<unsigned char>(in_body_.data()[0])) << 8 |
 		 static_cast<uint16_t>(static_cast<unsigned char>(in_body_.data()[1])));
 
+	if(in_body_.size() >= sizeof(LoginResponse) - sizeof(PacketHeader) + sizeof(LoginCapabilities))
+	{
+		LoginCapabilities capabilities;
+		std::memcpy(&capabilities,
+					in_body_.data() + sizeof(LoginResponse) - sizeof(PacketHeader),
+					sizeof(LoginCapabilities));
+		// Only the features of the version the server agreed on
+		uint16_t version = std::min<uint16_t>(ntohs(capabilities.version), PROTOCOL_VERSION);
+		features_ = ntohl(capabilities.features) & protocol_features(version);
+
+		if(features_ & FEATURE_CHACHA20)
+		{
+			chacha_key_ = derive_chacha20_key(
+				username_sum_, password_sum_, client_nonce_, ntohl(capabilities.nonce));
+		}
+	}
+
+	if(handlers_.login)
+	{
+		handlers_.login(status_code == 1);
+		return;
+	}
+
 	if(status_code == 1)
 	{
 		std::cout << "Login to server successful !\n";
@@ -185,12 +261,13 @@ void connection_manager::handle_login_response()
 	else
 	{
 		std::cerr << "Login failed with status: " << status_code << "\n";
-		socket_.close();
+		stream_.close();
 		return;
 	}
 }
 
-void connection_manager::handle_echo_response()
+template <typename Stream>
+void basic_connection_manager<Stream>::handle_echo_response()
 {
 	if(in_body_.size() < sizeof(uint16_t))
 	{
@@ -206,6 +283,12 @@ void connection_manager::handle_echo_response()
 	}
 
 	const char* msg_start = in_body_.data() + sizeof(uint16_t);
+	if(handlers_.echo)
+	{
+		handlers_.echo(msg_start, msg_size);
+		return;
+	}
+
 	std::string message(msg_start, msg_size);
 
 	std::cout << "Server responded with: " << message << "\n";
@@ -213,10 +296,40 @@ void connection_manager::handle_echo_response()
 	std::cout.flush();
 }
 
-void connection_manager::start_reading_input()
+template <typename Stream>
+void basic_connection_manager<Stream>::handle_broadcast_message()
+{
+	if(in_body_.size() < sizeof(uint16_t))
+	{
+		std::cerr << "Invalid broadcast size\n";
+		return;
+	}
+
+	uint16_t msg_size = ntohs(*reinterpret_cast<const uint16_t*>(in_body_.data()));
+	if(msg_size > in_body_.size() - sizeof(uint16_t))
+	{
+		std::cerr << "Message size mismatch" << in_body_.size() << " | " << msg_size << "\n";
+		return;
+	}
+
+	if(handlers_.broadcast)
+	{
+		handlers_.broadcast(in_body_.data() + sizeof(uint16_t), msg_size);
+		return;
+	}
+
+	std::string message(in_body_.data() + sizeof(uint16_t), msg_size);
+
+	std::cout << "\nBroadcast from " << message << "\n";
+	std::cout << "Enter message: ";
+	std::cout.flush();
+}
+
+template <typename Stream>
+void basic_connection_manager<Stream>::start_reading_input()
 {
 	auto self(shared_from_this());
-	stdin_.async_read_some(boost::asio::buffer(input_buffer_),
+	stdin_->async_read_some(boost::asio::buffer(input_buffer_),
 						   [this, self](const boost::system::error_code& ec, std::size_t length) {
 							   if(!ec)
 							   {
@@ -227,9 +340,13 @@ void connection_manager::start_reading_input()
 									   input.pop_back();
 								   }
 
-								   if(!input.empty())
+								   if(input.rfind(broadcast_prefix, 0) == 0)
 								   {
-									   send_echo_request(input);
+									   send_request(BROADCAST_REQUEST, input.substr(broadcast_prefix.size()));
+								   }
+								   else if(!input.empty())
+								   {
+									   send_request(ECHO_REQUEST, input);
 								   }
 
 								   start_reading_input();
@@ -241,10 +358,11 @@ void connection_manager::start_reading_input()
 						   });
 }
 
-void connection_manager::send_echo_request(const std::string& message)
+template <typename Stream>
+void basic_connection_manager<Stream>::send_request(MessageType type, std::string_view message)
 {
 	EchoRequest header{};
-	header.header.msg_type = ECHO_REQUEST;
+	header.header.msg_type = type;
 	header.header.msg_seq = msg_seq_;
 	uint16_t payload_len = static_cast<uint16_t>(message.size());
 	header.msg_size = payload_len;
@@ -252,11 +370,19 @@ void connection_manager::send_echo_request(const std::string& message)
 	uint8_t username_sum = username_sum_;
 	uint8_t password_sum = password_sum_;
 
-	uint32_t key_state = compute_initial_key(static_cast<uint32_t>(msg_seq_),
-											 static_cast<uint32_t>(username_sum),
-											 static_cast<uint32_t>(password_sum));
+	std::vector<uint8_t> cipher;
+	if(features_ & FEATURE_CHACHA20)
+	{
+		cipher = chacha20_operation(payload_len, chacha_key_, msg_seq_, message.data());
+	}
+	else
+	{
+		uint32_t key_state = compute_initial_key(static_cast<uint32_t>(msg_seq_),
+												 static_cast<uint32_t>(username_sum),
+												 static_cast<uint32_t>(password_sum));
 
-	std::vector<uint8_t> cipher = xor_operation(payload_len, key_state, message);
+		cipher = xor_operation(payload_len, key_state, message.data());
+	}
 
 	uint16_t total_size =
 		static_cast<uint16_t>(sizeof(PacketHeader) + sizeof(uint16_t) + payload_len);
@@ -273,13 +399,16 @@ void connection_manager::send_echo_request(const std::string& message)
 
 	auto self(shared_from_this());
 	boost::asio::async_write(
-		socket_,
+		stream_,
 		boost::asio::buffer(*buffer),
 		[this, self, buffer](const boost::system::error_code& ec, std::size_t) {
 			if(ec)
 			{
-				std::cerr << "Echo send error: " << ec.message() << "\n";
+				std::cerr << "Send error: " << ec.message() << "\n";
 				return;
 			}
 		});
-}
\ No newline at end of file
+}
+
+template class basic_connection_manager<tcp::socket>;
+template class basic_connection_manager<memory_stream>;
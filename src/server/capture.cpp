@@ -0,0 +1,205 @@
+#include "server/capture.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr char capture_magic[8] = {'E', 'C', 'H', 'O', 'C', 'A', 'P', 'T'};
+constexpr uint32_t capture_version = 1;
+
+std::runtime_error system_error(const std::string& what, const std::string& path)
+{
+	return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+} // namespace
+
+capture_writer::capture_writer(const std::string& path, size_t max_buffered)
+	: path_(path)
+	, max_buffered_(max_buffered)
+{
+	fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd_ < 0)
+	{
+		throw system_error("Failed to create capture file", path);
+	}
+
+	CaptureFileHeader header{};
+	std::memcpy(header.magic, capture_magic, sizeof(capture_magic));
+	header.version = capture_version;
+	pending_.insert(pending_.end(),
+					reinterpret_cast<const char*>(&header),
+					reinterpret_cast<const char*>(&header) + sizeof(header));
+
+	flusher_ = std::thread([this]() { run_flusher(); });
+}
+
+capture_writer::~capture_writer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	flusher_.join();
+	::close(fd_);
+}
+
+void capture_writer::record(uint64_t connection,
+							CaptureDirection direction,
+							const void* data,
+							size_t size,
+							const void* extra,
+							size_t extra_size)
+{
+	CaptureRecord record;
+	record.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+													std::chrono::system_clock::now().time_since_epoch())
+													.count());
+	record.connection = connection;
+	record.direction = direction;
+	record.reserved = 0;
+	record.size = static_cast<uint16_t>(size + extra_size);
+
+	const char* raw = reinterpret_cast<const char*>(&record);
+	const char* first = static_cast<const char*>(data);
+	const char* second = static_cast<const char*>(extra);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(pending_.size() + sizeof(record) + size + extra_size > max_buffered_ || size + extra_size > 0xFFFF)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	bool was_empty = pending_.empty();
+	pending_.insert(pending_.end(), raw, raw + sizeof(record));
+	pending_.insert(pending_.end(), first, first + size);
+	if(extra_size != 0)
+	{
+		pending_.insert(pending_.end(), second, second + extra_size);
+	}
+
+	if(was_empty)
+	{
+		wake_.notify_one();
+	}
+}
+
+void capture_writer::run_flusher()
+{
+	std::vector<char> writing;
+	for(;;)
+	{
+		bool stopping;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait_for(lock, std::chrono::milliseconds(50), [this]() {
+				return stopping_ || !pending_.empty();
+			});
+			stopping = stopping_;
+			writing.swap(pending_);
+		}
+
+		write_all(writing);
+		writing.clear();
+
+		if(stopping)
+		{
+			return;
+		}
+	}
+}
+
+void capture_writer::write_all(const std::vector<char>& buffer)
+{
+	size_t written = 0;
+	while(written < buffer.size())
+	{
+		ssize_t n = ::write(fd_, buffer.data() + written, buffer.size() - written);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			std::cerr << "Capture write failed for " << path_ << ": " << std::strerror(errno) << "\n";
+			return;
+		}
+		written += static_cast<size_t>(n);
+	}
+}
+
+capture_reader::capture_reader(const std::string& path)
+{
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd_ < 0)
+	{
+		throw system_error("Failed to open capture file", path);
+	}
+
+	struct stat st;
+	if(::fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureFileHeader))
+	{
+		::close(fd_);
+		throw std::runtime_error("Not a capture file: " + path);
+	}
+	size_ = static_cast<size_t>(st.st_size);
+
+	void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if(data == MAP_FAILED)
+	{
+		::close(fd_);
+		throw system_error("Failed to map capture file", path);
+	}
+	data_ = static_cast<const char*>(data);
+	::madvise(data, size_, MADV_SEQUENTIAL);
+
+	CaptureFileHeader header;
+	std::memcpy(&header, data_, sizeof(header));
+	if(std::memcmp(header.magic, capture_magic, sizeof(capture_magic)) != 0 || header.version != capture_version)
+	{
+		::munmap(data, size_);
+		::close(fd_);
+		throw std::runtime_error("Not a capture file: " + path);
+	}
+	offset_ = sizeof(CaptureFileHeader);
+}
+
+capture_reader::~capture_reader()
+{
+	::munmap(const_cast<char*>(data_), size_);
+	::close(fd_);
+}
+
+bool capture_reader::next(capture_entry& entry)
+{
+	if(offset_ + sizeof(CaptureRecord) > size_)
+	{
+		return false;
+	}
+
+	CaptureRecord record;
+	std::memcpy(&record, data_ + offset_, sizeof(record));
+	if(offset_ + sizeof(record) + record.size > size_)
+	{
+		return false;
+	}
+
+	entry.timestamp_ns = record.timestamp_ns;
+	entry.connection = record.connection;
+	entry.direction = static_cast<CaptureDirection>(record.direction);
+	entry.data = data_ + offset_ + sizeof(record);
+	entry.size = record.size;
+	offset_ += sizeof(record) + record.size;
+	return true;
+}
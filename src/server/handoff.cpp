@@ -0,0 +1,641 @@
+#include "server/handoff.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+
+using handoff_clock = std::chrono::steady_clock;
+
+/// How long a session waits for a write to a client that stopped reading,
+/// then the write is cancelled and the unsent bytes move with the session
+constexpr std::chrono::seconds write_timeout{1};
+
+/// How long the sessions get to reach a frame boundary, the ones that didn't
+/// are left behind and closed with the old server
+constexpr std::chrono::seconds freeze_timeout{30};
+
+/// How long the old server waits for the new one to acknowledge after
+/// HANDOFF_END, it only has the last messages in the socket left to read
+constexpr std::chrono::seconds ack_timeout{10};
+
+/// How long an old server that closed the handoff early gets to exit
+constexpr std::chrono::seconds exit_timeout{1};
+
+/// Larger than any session can be, guards against reading garbage
+constexpr uint32_t max_message_size = 16 * 1024 * 1024;
+
+std::runtime_error system_error(const std::string& what)
+{
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+void write_all(int sock, const char* data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t n = ::send(sock, data, size, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			throw system_error("Failed to write to the handoff socket");
+		}
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+}
+
+void read_all(int sock, char* data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t n = ::read(sock, data, size);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			throw system_error("Failed to read from the handoff socket");
+		}
+		if(n == 0)
+		{
+			throw std::runtime_error("The handoff socket was closed in the middle of a message");
+		}
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+}
+
+/// @brief Sends a message, fd (if not -1) is attached to it with SCM_RIGHTS.
+void send_message(int sock, HandoffMessageType type, const std::vector<char>& body, int fd)
+{
+	HandoffMessage header{type, static_cast<uint32_t>(body.size())};
+
+	iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = const_cast<char*>(body.data());
+	iov[1].iov_len = body.size();
+
+	msghdr msg{};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = body.empty() ? 1 : 2;
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	if(fd >= 0)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t sent;
+	do
+	{
+		sent = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while(sent < 0 && errno == EINTR);
+	if(sent < 0)
+	{
+		throw system_error("Failed to send on the handoff socket");
+	}
+
+	// The descriptor went with the first byte, a short send is finished with plain writes
+	size_t done = static_cast<size_t>(sent);
+	if(done < sizeof(header))
+	{
+		write_all(sock, reinterpret_cast<const char*>(&header) + done, sizeof(header) - done);
+		done = sizeof(header);
+	}
+	size_t body_done = done - sizeof(header);
+	write_all(sock, body.data() + body_done, body.size() - body_done);
+}
+
+/// @brief Receives the next message and the descriptor attached to it (-1 if none).
+/// Returns false when the other end closed the socket between two messages.
+bool receive_message(int sock, HandoffMessage& header, std::vector<char>& body, int& fd)
+{
+	fd = -1;
+
+	iovec iov;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do
+	{
+		received = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while(received < 0 && errno == EINTR);
+	if(received < 0)
+	{
+		throw system_error("Failed to receive on the handoff socket");
+	}
+	if(received == 0)
+	{
+		return false;
+	}
+
+	for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if(msg.msg_flags & MSG_CTRUNC)
+	{
+		throw std::runtime_error("A descriptor was lost on the handoff socket, out of file descriptors?");
+	}
+
+	size_t done = static_cast<size_t>(received);
+	read_all(sock, reinterpret_cast<char*>(&header) + done, sizeof(header) - done);
+	if(header.size > max_message_size)
+	{
+		throw std::runtime_error("Invalid handoff message size: " + std::to_string(header.size));
+	}
+
+	body.resize(header.size);
+	read_all(sock, body.data(), body.size());
+	return true;
+}
+
+/// @brief Waits for the new server to acknowledge. At the timeout the socket
+/// stops reading first, an acknowledgement sent from then on fails on the new
+/// server instead of going unnoticed: never both servers own the sessions.
+bool wait_for_ack(int sock)
+{
+	pollfd readable{sock, POLLIN, 0};
+	int ready;
+	do
+	{
+		ready = ::poll(&readable, 1, static_cast<int>(std::chrono::milliseconds(ack_timeout).count()));
+	} while(ready < 0 && errno == EINTR);
+	if(ready <= 0)
+	{
+		::shutdown(sock, SHUT_RD);
+	}
+
+	HandoffMessage header;
+	std::vector<char> body;
+	int fd;
+	if(!receive_message(sock, header, body, fd))
+	{
+		return false;
+	}
+	if(fd >= 0)
+	{
+		::close(fd);
+	}
+	return header.type == HANDOFF_ACK;
+}
+
+/// @brief Tells whether the server at the other end of sock still runs. Its
+/// sockets close before it exits, so a server on its way out gets a moment.
+bool peer_running(int sock)
+{
+	ucred peer{};
+	socklen_t size = sizeof(peer);
+	if(::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &size) != 0)
+	{
+		return true;
+	}
+
+	auto deadline = handoff_clock::now() + exit_timeout;
+	while(true)
+	{
+		std::ifstream stat("/proc/" + std::to_string(peer.pid) + "/stat");
+		std::string line;
+		if(!std::getline(stat, line))
+		{
+			return false;
+		}
+		// The state follows the command name, which may contain anything
+		size_t name_end = line.rfind(')');
+		if(name_end != std::string::npos && name_end + 2 < line.size() &&
+		   (line[name_end + 2] == 'Z' || line[name_end + 2] == 'X'))
+		{
+			return false;
+		}
+		if(handoff_clock::now() >= deadline)
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+} // namespace
+
+std::vector<char> encode_session_handoff(const session_handoff& state)
+{
+	HandoffSession session{};
+	session.logged_in = state.logged_in ? 1 : 0;
+	session.username_sum = state.username_sum;
+	session.password_sum = state.password_sum;
+	session.broadcast_seq = state.broadcast_seq;
+	session.features = state.features;
+	std::memcpy(session.chacha_key, state.chacha_key.words, sizeof(session.chacha_key));
+	session.client_id_size = static_cast<uint16_t>(state.client_id.size());
+	session.input_size = static_cast<uint32_t>(state.input.size());
+	session.output_size = static_cast<uint32_t>(state.output.size());
+	session.captured_size = static_cast<uint32_t>(state.captured_size);
+
+	std::vector<char> body(sizeof(session) + state.client_id.size() + state.input.size() + state.output.size());
+	char* p = body.data();
+	std::memcpy(p, &session, sizeof(session));
+	p += sizeof(session);
+	std::memcpy(p, state.client_id.data(), state.client_id.size());
+	p += state.client_id.size();
+	std::memcpy(p, state.input.data(), state.input.size());
+	p += state.input.size();
+	std::memcpy(p, state.output.data(), state.output.size());
+	return body;
+}
+
+bool decode_session_handoff(const char* data, size_t size, session_handoff& state)
+{
+	HandoffSession session;
+	if(size < sizeof(session))
+	{
+		return false;
+	}
+	std::memcpy(&session, data, sizeof(session));
+
+	size_t expected = sizeof(session) + session.client_id_size + static_cast<size_t>(session.input_size) +
+					  session.output_size;
+	if(size != expected || session.captured_size > session.output_size)
+	{
+		return false;
+	}
+
+	state.logged_in = session.logged_in != 0;
+	state.username_sum = session.username_sum;
+	state.password_sum = session.password_sum;
+	state.broadcast_seq = session.broadcast_seq;
+	state.features = session.features;
+	std::memcpy(state.chacha_key.words, session.chacha_key, sizeof(session.chacha_key));
+
+	const char* p = data + sizeof(session);
+	state.client_id.assign(p, session.client_id_size);
+	p += session.client_id_size;
+	state.input.assign(p, p + session.input_size);
+	p += session.input_size;
+	state.output.assign(p, p + session.output_size);
+	state.captured_size = session.captured_size;
+	return true;
+}
+
+handoff_listener::handoff_listener(boost::asio::io_context& io_context,
+								   const std::string& path,
+								   std::function<void()> on_done,
+								   bool staged)
+	: acceptor_(io_context)
+	, path_(path)
+	, bound_path_(staged ? path + ".next" : path)
+	, on_done_(std::move(on_done))
+{
+	// Left behind by a server that crashed
+	::unlink(bound_path_.c_str());
+
+	boost::asio::local::stream_protocol::endpoint endpoint(bound_path_);
+	acceptor_.open(endpoint.protocol());
+	acceptor_.bind(endpoint);
+	acceptor_.listen();
+}
+
+handoff_listener::~handoff_listener()
+{
+	boost::system::error_code ec;
+	acceptor_.close(ec);
+	if(worker_.joinable())
+	{
+		worker_.join();
+	}
+	if(!handed_off_)
+	{
+		::unlink(bound_path_.c_str());
+	}
+}
+
+void handoff_listener::start(session_manager& manager)
+{
+	manager_ = &manager;
+	do_accept();
+}
+
+bool handoff_listener::publish()
+{
+	if(bound_path_ == path_)
+	{
+		return true;
+	}
+	if(::rename(bound_path_.c_str(), path_.c_str()) != 0)
+	{
+		std::cerr << "Failed to move the handoff socket to " << path_ << ": " << std::strerror(errno)
+				  << ", the next server takes over from " << bound_path_ << "\n";
+		return false;
+	}
+	bound_path_ = path_;
+	return true;
+}
+
+void handoff_listener::do_accept()
+{
+	acceptor_.async_accept([this](boost::system::error_code ec, boost::asio::local::stream_protocol::socket socket) {
+		if(ec)
+		{
+			return;
+		}
+
+		// One handoff at a time, the acceptor is armed again only if this one fails
+		int fd = socket.release(ec);
+		if(ec)
+		{
+			return;
+		}
+		if(worker_.joinable())
+		{
+			// The failed handoff's worker, it finishes right after arming the acceptor
+			worker_.join();
+		}
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		work_.emplace(boost::asio::make_work_guard(manager_->io_context()));
+		worker_ = std::thread([this, fd]() { run_handoff(fd); });
+	});
+}
+
+void handoff_listener::run_handoff(int fd)
+{
+	auto start = handoff_clock::now();
+
+	struct frozen_sessions
+	{
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::deque<session_handoff> sessions;
+		bool abandoned{false};
+	};
+	auto frozen = std::make_shared<frozen_sessions>();
+
+	// Everything sent stays open here until the new server acknowledges
+	int listener = -1;
+	std::vector<session_handoff> kept;
+	size_t ended = 0;
+	bool acknowledged = false;
+
+	try
+	{
+		// The listening socket first, the new server accepts as soon as it acknowledges
+		listener = manager_->release_listener();
+		if(listener < 0)
+		{
+			throw std::runtime_error("Failed to release the listening socket");
+		}
+		send_message(fd, HANDOFF_LISTENER, {}, listener);
+
+		session_manager* manager = manager_;
+		size_t count = manager_->hand_off_sessions(
+			[frozen, manager](session_handoff state) {
+				std::unique_lock<std::mutex> lock(frozen->mutex);
+				if(frozen->abandoned)
+				{
+					// Froze after the handoff failed, served again right away
+					lock.unlock();
+					if(state.fd >= 0)
+					{
+						manager->adopt_session(std::move(state));
+					}
+					return;
+				}
+				frozen->sessions.push_back(std::move(state));
+				lock.unlock();
+				frozen->ready.notify_one();
+			},
+			write_timeout);
+
+		// Sent as they freeze, a slow session doesn't hold back the others
+		auto deadline = handoff_clock::now() + freeze_timeout;
+		for(size_t i = 0; i < count; ++i)
+		{
+			session_handoff state;
+			{
+				std::unique_lock<std::mutex> lock(frozen->mutex);
+				if(!frozen->ready.wait_until(lock, deadline, [&frozen]() { return !frozen->sessions.empty(); }))
+				{
+					// The new server still gets everything that froze
+					std::cerr << "Timed out waiting for " << count - i << " sessions to freeze, they are closed\n";
+					break;
+				}
+				state = std::move(frozen->sessions.front());
+				frozen->sessions.pop_front();
+			}
+
+			if(state.fd < 0)
+			{
+				++ended;
+				continue;
+			}
+			kept.push_back(std::move(state));
+			send_message(fd, HANDOFF_SESSION, encode_session_handoff(kept.back()), kept.back().fd);
+		}
+
+		send_message(fd, HANDOFF_END, {}, -1);
+		acknowledged = wait_for_ack(fd);
+		if(!acknowledged)
+		{
+			std::cerr << "Handoff failed: the new server didn't acknowledge\n";
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Handoff failed: " << e.what() << "\n";
+	}
+
+	::close(fd);
+
+	if(acknowledged)
+	{
+		::close(listener);
+		for(const session_handoff& state : kept)
+		{
+			::close(state.fd);
+		}
+		handed_off_ = true;
+
+		auto elapsed = std::chrono::duration<double, std::milli>(handoff_clock::now() - start).count();
+		std::cout << "Handed off " << kept.size() << " sessions (" << ended << " had ended) in " << elapsed
+				  << " ms\n";
+
+		// Without its listening socket this server has nothing left to do
+		on_done_();
+		work_.reset();
+		return;
+	}
+
+	// Nothing was lost: accept again and serve every session that froze, sent or not
+	if(listener >= 0)
+	{
+		manager_->restore_listener(listener);
+	}
+	{
+		std::lock_guard<std::mutex> lock(frozen->mutex);
+		frozen->abandoned = true;
+		for(session_handoff& state : frozen->sessions)
+		{
+			kept.push_back(std::move(state));
+		}
+		frozen->sessions.clear();
+	}
+	size_t resumed = 0;
+	for(session_handoff& state : kept)
+	{
+		if(state.fd >= 0 && manager_->adopt_session(std::move(state)))
+		{
+			++resumed;
+		}
+	}
+	std::cerr << "Serving the " << resumed << " sessions again, waiting for another server to take over\n";
+
+	boost::asio::post(acceptor_.get_executor(), [this]() { do_accept(); });
+	work_.reset();
+}
+
+std::unique_ptr<session_manager> take_over(boost::asio::io_context& io_context,
+										   std::shared_ptr<server_context> context,
+										   const std::string& path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(address.sun_path))
+	{
+		throw std::runtime_error("Handoff socket path is too long: " + path);
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0)
+	{
+		throw system_error("Failed to create the handoff socket");
+	}
+
+	try
+	{
+		if(::connect(sock, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+		{
+			throw system_error("Failed to connect to the handoff socket " + path);
+		}
+		auto start = handoff_clock::now();
+
+		HandoffMessage header;
+		std::vector<char> body;
+		int fd = -1;
+		if(!receive_message(sock, header, body, fd) || header.type != HANDOFF_LISTENER || fd < 0)
+		{
+			throw std::runtime_error("The old server didn't hand off its listening socket");
+		}
+		auto manager = std::make_unique<session_manager>(io_context, std::move(context), fd);
+
+		// Nothing runs before the acknowledgement, until then the old server owns everything
+		size_t adopted = 0;
+		size_t failed = 0;
+		bool complete = false;
+		try
+		{
+			while(receive_message(sock, header, body, fd))
+			{
+				if(header.type == HANDOFF_END)
+				{
+					complete = true;
+					break;
+				}
+
+				session_handoff state;
+				if(header.type != HANDOFF_SESSION || fd < 0 ||
+				   !decode_session_handoff(body.data(), body.size(), state))
+				{
+					std::cerr << "Skipping a malformed handoff message\n";
+					if(fd >= 0)
+					{
+						::close(fd);
+					}
+					++failed;
+					continue;
+				}
+				state.fd = fd;
+
+				try
+				{
+					if(manager->adopt_session(std::move(state)))
+					{
+						++adopted;
+						continue;
+					}
+					std::cerr << "Failed to adopt a handed off socket\n";
+				}
+				catch(std::exception& e)
+				{
+					std::cerr << "Failed to adopt a handed off session: " << e.what() << "\n";
+				}
+				++failed;
+			}
+		}
+		catch(std::exception& e)
+		{
+			std::cerr << "Handoff interrupted: " << e.what() << "\n";
+		}
+
+		if(complete)
+		{
+			// Fails if the old server gave up waiting, it serves everything again
+			send_message(sock, HANDOFF_ACK, {}, -1);
+		}
+		else if(peer_running(sock))
+		{
+			// It sees this socket close and serves everything again
+			throw std::runtime_error("The handoff was cut short, the old server keeps serving");
+		}
+		else
+		{
+			std::cerr << "The old server exited before the end of the handoff, keeping the " << adopted
+					  << " sessions taken over so far\n";
+		}
+		::close(sock);
+
+		auto elapsed = std::chrono::duration<double, std::milli>(handoff_clock::now() - start).count();
+		std::cout << "Took over " << adopted << " sessions (" << failed << " failed) in " << elapsed << " ms\n";
+		return manager;
+	}
+	catch(...)
+	{
+		::close(sock);
+		throw;
+	}
+}
@@ -0,0 +1,512 @@
+#include "server/journal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr char journal_magic[8] = {'E', 'C', 'H', 'O', 'J', 'R', 'N', 'L'};
+constexpr uint32_t journal_version = 1;
+constexpr size_t record_alignment = 8;
+
+std::atomic<uint64_t> next_journal_id{1};
+
+size_t align_record(size_t size)
+{
+	return (size + record_alignment - 1) & ~(record_alignment - 1);
+}
+
+size_t first_record_offset()
+{
+	return align_record(sizeof(JournalSegmentHeader));
+}
+
+std::runtime_error system_error(const std::string& what, const std::string& path)
+{
+	return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+uint32_t fnv1a(uint32_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+} // namespace
+
+uint32_t journal_checksum(const JournalRecord& record, const char* client_id, const char* message)
+{
+	uint32_t hash = 2166136261u;
+	hash = fnv1a(hash, &record.timestamp_ns, sizeof(record.timestamp_ns));
+	hash = fnv1a(hash, &record.seq, sizeof(record.seq));
+	hash = fnv1a(hash, &record.client_id_size, sizeof(record.client_id_size));
+	hash = fnv1a(hash, &record.message_size, sizeof(record.message_size));
+	hash = fnv1a(hash, client_id, record.client_id_size);
+	hash = fnv1a(hash, message, record.message_size);
+	return hash;
+}
+
+journal::journal(const journal_options& options)
+	: options_(options)
+	, id_(next_journal_id.fetch_add(1))
+{
+	const size_t max_record = align_record(sizeof(JournalRecord) + 0xFFFF * 2);
+	if(options_.segment_size < first_record_offset() + max_record)
+	{
+		throw std::runtime_error("journal segment size is too small");
+	}
+	if(options_.buffer_size < max_record)
+	{
+		throw std::runtime_error("journal buffer size is too small");
+	}
+
+	std::filesystem::create_directories(options_.directory);
+
+	// Continue after the segments left by the previous runs instead of overwriting them
+	uint64_t first_segment = 0;
+	for(const std::string& path : list_journal_segments(options_.directory))
+	{
+		unsigned index = 0;
+		unsigned long long number = 0;
+		if(std::sscanf(std::filesystem::path(path).filename().c_str(), "%u-%llu.journal", &index, &number) == 2)
+		{
+			first_segment = std::max<uint64_t>(first_segment, number + 1);
+		}
+	}
+
+	for(size_t i = 0; i < std::max<size_t>(options_.writers, 1); ++i)
+	{
+		auto w = std::make_unique<writer>();
+		w->index = static_cast<uint32_t>(i);
+		w->next_segment = first_segment;
+
+		// Populated here so the io_context threads don't take the page faults, record
+		// offsets stay 8 byte aligned across the wrap
+		w->ring_size = align_record(options_.buffer_size);
+		void* ring = ::mmap(
+			nullptr, w->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if(ring == MAP_FAILED)
+		{
+			throw system_error("Failed to map the journal buffer of writer", std::to_string(i));
+		}
+		w->ring = static_cast<char*>(ring);
+		writers_.push_back(std::move(w));
+
+		writers_.back()->file = create_segment(*writers_.back());
+	}
+
+	flusher_ = std::thread([this]() { run_flusher(); });
+}
+
+journal::~journal()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	flusher_.join();
+
+	for(auto& w : writers_)
+	{
+		close_segment(std::move(w->file));
+		::munmap(w->ring, w->ring_size);
+	}
+}
+
+journal::writer* journal::local_writer()
+{
+	struct cached_writer
+	{
+		uint64_t journal_id{0};
+		writer* w{nullptr};
+	};
+	thread_local cached_writer cache;
+
+	if(cache.journal_id != id_)
+	{
+		size_t index = next_writer_.fetch_add(1, std::memory_order_relaxed);
+		cache.journal_id = id_;
+		cache.w = index < writers_.size() ? writers_[index].get() : nullptr;
+	}
+	return cache.w;
+}
+
+void journal::append(const std::string& client_id, uint32_t seq, const uint8_t* message, size_t size)
+{
+	writer* w = local_writer();
+	if(w == nullptr || client_id.size() > 0xFFFF || size > 0xFFFF)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	size_t record_size = align_record(sizeof(JournalRecord) + client_id.size() + size);
+	uint64_t head = w->head.load(std::memory_order_relaxed);
+	uint64_t used = head - w->tail.load(std::memory_order_acquire);
+	if(used + record_size > w->ring_size)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		wake_.notify_one();
+		return;
+	}
+
+	JournalRecord record;
+	record.size = static_cast<uint32_t>(record_size);
+	record.timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+													std::chrono::system_clock::now().time_since_epoch())
+													.count());
+	record.seq = seq;
+	record.client_id_size = static_cast<uint16_t>(client_id.size());
+	record.message_size = static_cast<uint16_t>(size);
+	record.checksum = journal_checksum(record, client_id.data(), reinterpret_cast<const char*>(message));
+
+	// A record may wrap around the end of the ring
+	uint64_t offset = head;
+	auto copy = [w, &offset](const void* data, size_t length) {
+		const char* bytes = static_cast<const char*>(data);
+		while(length > 0)
+		{
+			size_t at = offset % w->ring_size;
+			size_t chunk = std::min(length, w->ring_size - at);
+			std::memcpy(w->ring + at, bytes, chunk);
+			bytes += chunk;
+			length -= chunk;
+			offset += chunk;
+		}
+	};
+	static constexpr char padding[record_alignment] = {};
+	copy(&record, sizeof(JournalRecord));
+	copy(client_id.data(), client_id.size());
+	copy(message, size);
+	copy(padding, head + record_size - offset);
+
+	// The flusher only ever reads below head, so it never sees half a record
+	w->head.store(head + record_size, std::memory_order_release);
+	records_.fetch_add(1, std::memory_order_relaxed);
+
+	// Wake the flusher early when the ring fills faster than it drains on its interval
+	if(used < w->ring_size / 2 && used + record_size >= w->ring_size / 2)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			work_pending_ = true;
+		}
+		wake_.notify_one();
+	}
+}
+
+std::unique_ptr<journal::segment> journal::create_segment(writer& w)
+{
+	auto s = std::make_unique<segment>();
+	s->capacity = options_.segment_size;
+
+	// Never reuse a segment, another process may still be writing to the same directory
+	for(;;)
+	{
+		char name[64];
+		std::snprintf(name, sizeof(name), "%04u-%08llu.journal", w.index,
+					  static_cast<unsigned long long>(w.next_segment));
+		s->path = (std::filesystem::path(options_.directory) / name).string();
+
+		s->fd = ::open(s->path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if(s->fd >= 0)
+		{
+			break;
+		}
+		if(errno != EEXIST)
+		{
+			throw system_error("Failed to create journal segment", s->path);
+		}
+		++w.next_segment;
+	}
+
+	// Allocate the blocks up front so writing never has to extend the file
+	if(::posix_fallocate(s->fd, 0, static_cast<off_t>(s->capacity)) != 0 &&
+	   ::ftruncate(s->fd, static_cast<off_t>(s->capacity)) != 0)
+	{
+		::close(s->fd);
+		throw system_error("Failed to size journal segment", s->path);
+	}
+
+	char header_block[record_alignment * 4] = {};
+	static_assert(sizeof(header_block) >= sizeof(JournalSegmentHeader), "the header must fit");
+	JournalSegmentHeader header{};
+	std::memcpy(header.magic, journal_magic, sizeof(journal_magic));
+	header.version = journal_version;
+	header.writer = w.index;
+	header.segment = w.next_segment++;
+	std::memcpy(header_block, &header, sizeof(header));
+	if(::pwrite(s->fd, header_block, first_record_offset(), 0) != static_cast<ssize_t>(first_record_offset()))
+	{
+		::close(s->fd);
+		throw system_error("Failed to write the header of journal segment", s->path);
+	}
+	s->written = first_record_offset();
+
+	return s;
+}
+
+void journal::drain(writer& w)
+{
+	uint64_t head = w.head.load(std::memory_order_acquire);
+	uint64_t tail = w.tail.load(std::memory_order_relaxed);
+
+	while(tail < head && w.file)
+	{
+		// The run of records that still fits in the current segment
+		uint64_t end = tail;
+		while(end < head)
+		{
+			// Records are 8 byte aligned, their size never straddles the end of the ring
+			uint32_t record_size;
+			std::memcpy(&record_size, w.ring + end % w.ring_size, sizeof(record_size));
+			if(w.file->written + (end - tail) + record_size > w.file->capacity)
+			{
+				break;
+			}
+			end += record_size;
+		}
+
+		if(end == tail)
+		{
+			// Full, the records continue in the next segment
+			close_segment(std::move(w.file));
+			try
+			{
+				w.file = create_segment(w);
+			}
+			catch(std::exception& e)
+			{
+				std::cerr << "Journal: " << e.what() << "\n";
+			}
+			continue;
+		}
+
+		size_t at = tail % w.ring_size;
+		size_t length = end - tail;
+		size_t first = std::min(length, w.ring_size - at);
+		iovec iov[2] = {{w.ring + at, first}, {w.ring, length - first}};
+		int iov_count = first < length ? 2 : 1;
+
+		size_t done = 0;
+		while(done < length)
+		{
+			ssize_t n = ::pwritev(w.file->fd, iov, iov_count, static_cast<off_t>(w.file->written + done));
+			if(n < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				std::cerr << "Journal write failed for " << w.file->path << ": " << std::strerror(errno) << "\n";
+				return;
+			}
+			done += static_cast<size_t>(n);
+
+			// Rare short write, continue from where it stopped
+			size_t skip = static_cast<size_t>(n);
+			for(int i = 0; i < iov_count && skip > 0; ++i)
+			{
+				size_t step = std::min(skip, iov[i].iov_len);
+				iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + step;
+				iov[i].iov_len -= step;
+				skip -= step;
+			}
+		}
+
+		w.file->written += length;
+		tail = end;
+		w.tail.store(tail, std::memory_order_release);
+	}
+}
+
+void journal::sync_segment(segment& s)
+{
+	if(s.written > s.synced)
+	{
+		if(::fdatasync(s.fd) != 0)
+		{
+			std::cerr << "Journal sync failed for " << s.path << ": " << std::strerror(errno) << "\n";
+			return;
+		}
+		s.synced = s.written;
+	}
+}
+
+void journal::close_segment(std::unique_ptr<segment> s)
+{
+	if(!s)
+	{
+		return;
+	}
+	if(options_.fsync_interval.count() > 0)
+	{
+		sync_segment(*s);
+	}
+
+	if(::ftruncate(s->fd, static_cast<off_t>(s->written)) != 0)
+	{
+		std::cerr << "Journal trim failed for " << s->path << ": " << std::strerror(errno) << "\n";
+	}
+	::close(s->fd);
+}
+
+void journal::run_flusher()
+{
+	// Wake up often enough to drain the rings even without fsync
+	auto interval = options_.fsync_interval.count() > 0 ? options_.fsync_interval
+														: std::chrono::milliseconds(100);
+	auto drain_interval = std::min(interval, std::chrono::milliseconds(10));
+	auto next_sync = std::chrono::steady_clock::now() + interval;
+
+	for(;;)
+	{
+		bool stopping;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			auto wake_at = std::min(next_sync, std::chrono::steady_clock::now() + drain_interval);
+			wake_.wait_until(lock, wake_at, [this]() { return stopping_ || work_pending_; });
+			work_pending_ = false;
+			stopping = stopping_;
+		}
+
+		for(auto& w : writers_)
+		{
+			if(!w->file)
+			{
+				// The last segment couldn't be created, try again
+				try
+				{
+					w->file = create_segment(*w);
+				}
+				catch(std::exception& e)
+				{
+					std::cerr << "Journal: " << e.what() << "\n";
+					continue;
+				}
+			}
+			drain(*w);
+		}
+
+		if(std::chrono::steady_clock::now() >= next_sync || stopping)
+		{
+			if(options_.fsync_interval.count() > 0)
+			{
+				for(auto& w : writers_)
+				{
+					if(w->file)
+					{
+						sync_segment(*w->file);
+					}
+				}
+			}
+			next_sync = std::chrono::steady_clock::now() + interval;
+		}
+
+		if(stopping)
+		{
+			return;
+		}
+	}
+}
+
+journal_segment_reader::journal_segment_reader(const std::string& path)
+{
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd_ < 0)
+	{
+		throw system_error("Failed to open journal segment", path);
+	}
+
+	struct stat st;
+	if(::fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(JournalSegmentHeader))
+	{
+		::close(fd_);
+		throw std::runtime_error("Not a journal segment: " + path);
+	}
+	size_ = static_cast<size_t>(st.st_size);
+
+	void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if(data == MAP_FAILED)
+	{
+		::close(fd_);
+		throw system_error("Failed to map journal segment", path);
+	}
+	data_ = static_cast<const char*>(data);
+	::madvise(data, size_, MADV_SEQUENTIAL);
+
+	if(std::memcmp(header().magic, journal_magic, sizeof(journal_magic)) != 0 ||
+	   header().version != journal_version)
+	{
+		::munmap(data, size_);
+		::close(fd_);
+		throw std::runtime_error("Not a journal segment: " + path);
+	}
+	offset_ = first_record_offset();
+}
+
+journal_segment_reader::~journal_segment_reader()
+{
+	::munmap(const_cast<char*>(data_), size_);
+	::close(fd_);
+}
+
+bool journal_segment_reader::next(journal_entry& entry)
+{
+	if(offset_ + sizeof(JournalRecord) > size_)
+	{
+		return false;
+	}
+
+	JournalRecord record;
+	std::memcpy(&record, data_ + offset_, sizeof(JournalRecord));
+	size_t payload = sizeof(JournalRecord) + record.client_id_size + record.message_size;
+	if(record.size == 0 || record.size != align_record(payload) || offset_ + record.size > size_)
+	{
+		return false;
+	}
+
+	const char* client_id = data_ + offset_ + sizeof(JournalRecord);
+	const char* message = client_id + record.client_id_size;
+	if(journal_checksum(record, client_id, message) != record.checksum)
+	{
+		return false;
+	}
+
+	entry.seq = record.seq;
+	entry.timestamp_ns = record.timestamp_ns;
+	entry.client_id = std::string_view(client_id, record.client_id_size);
+	entry.message = std::string_view(message, record.message_size);
+	offset_ += record.size;
+	return true;
+}
+
+std::vector<std::string> list_journal_segments(const std::string& directory)
+{
+	std::vector<std::string> segments;
+	for(const auto& file : std::filesystem::directory_iterator(directory))
+	{
+		if(file.is_regular_file() && file.path().extension() == ".journal")
+		{
+			segments.push_back(file.path().string());
+		}
+	}
+	std::sort(segments.begin(), segments.end());
+	return segments;
+}
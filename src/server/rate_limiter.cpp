@@ -0,0 +1,88 @@
+#include "server/rate_limiter.h"
+
+#include <algorithm>
+#include <iterator>
+
+token_bucket::token_bucket(double rate, double burst)
+	: rate_(rate)
+	, burst_(std::max(burst, 1.0))
+	, tokens_(burst_)
+	, last_refill_(clock::now())
+{ }
+
+void token_bucket::refill(clock::time_point now)
+{
+	if(now <= last_refill_)
+	{
+		return;
+	}
+
+	double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+	tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+	last_refill_ = now;
+}
+
+void token_bucket::consume(size_t bytes, clock::time_point now)
+{
+	if(!enabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	refill(now);
+	tokens_ -= static_cast<double>(bytes);
+}
+
+token_bucket::clock::duration token_bucket::delay(clock::time_point now)
+{
+	if(!enabled())
+	{
+		return clock::duration::zero();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	refill(now);
+	if(tokens_ >= 0)
+	{
+		return clock::duration::zero();
+	}
+
+	return std::chrono::duration_cast<clock::duration>(
+		std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+rate_limiter::rate_limiter(double user_rate, double user_burst)
+	: user_rate_(user_rate)
+	, user_burst_(user_burst)
+{ }
+
+std::shared_ptr<token_bucket> rate_limiter::user_bucket(const std::string& client_id)
+{
+	if(user_rate_ <= 0)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto& entry = users_[client_id];
+	auto bucket = entry.lock();
+	if(!bucket)
+	{
+		bucket = std::make_shared<token_bucket>(user_rate_, user_burst_);
+		entry = bucket;
+
+		// The map only holds weak references, once in a while drop the clients
+		// that logged out so it doesn't grow with every username ever seen.
+		if(users_.size() > sweep_threshold_)
+		{
+			for(auto it = users_.begin(); it != users_.end();)
+			{
+				it = it->second.expired() ? users_.erase(it) : std::next(it);
+			}
+			sweep_threshold_ = std::max<size_t>(64, users_.size() * 2);
+		}
+	}
+	return bucket;
+}
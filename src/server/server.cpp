@@ -1,14 +1,131 @@
+#include <boost/program_options.hpp>
+#include <thread>
+
+#include "server/handoff.h"
 #include "server/session_manager.h"
 
+namespace po = boost::program_options;
+
 int main(int argc, char* argv[])
 {
 	try
 	{
+		server_options options;
+		std::string trace_file;
+		std::string handoff_socket;
+
+		po::options_description desc("Usage: server [options]");
+		desc.add_options()
+			("help,h", "Print this message")
+			("port,p", po::value(&options.port)->default_value(options.port), "Port to listen on")
+			("threads,t", po::value(&options.threads)->default_value(options.threads),
+			 "Threads running the io_context")
+			("legacy-cipher", "Don't offer the ChaCha20 cipher to the clients, always use the LCG")
+			("journal-dir", po::value(&options.journal_dir), "Journal the echoed messages to this directory")
+			("journal-segment-mb", po::value<size_t>()->default_value(options.journal_segment_size >> 20),
+			 "Size of the journal segments in MiB")
+			("journal-buffer-mb", po::value<size_t>()->default_value(options.journal_buffer_size >> 20),
+			 "Memory every io thread stages journal records in, in MiB")
+			("journal-fsync-ms", po::value<long>()->default_value(options.journal_fsync_interval.count()),
+			 "Milliseconds between two syncs of the journal, 0 leaves it to the OS")
+			("capture-file", po::value(&options.capture_file), "Record every frame to this file for the replay tool")
+			("quiet,q", "Don't print the logins and the echoed messages")
+			("handoff-socket", po::value(&handoff_socket),
+			 "Unix socket a new server connects to with --takeover to take over the connections")
+			("takeover", "Take over the listening socket and the sessions of the server on --handoff-socket")
+#ifdef ECHO_TRACING
+			("trace-file", po::value(&trace_file), "Write the stages of the sessions as Chrome trace JSON at exit")
+#endif
+			("frames-per-turn", po::value(&options.frames_per_turn)->default_value(options.frames_per_turn),
+			 "Frames a session handles before yielding to the others, 0 for no limit")
+			("bytes-per-turn", po::value(&options.bytes_per_turn)->default_value(options.bytes_per_turn),
+			 "Bytes a session handles before yielding to the others, 0 for no limit")
+			("session-rate", po::value(&options.session_rate)->default_value(options.session_rate),
+			 "Bytes per second allowed for each session, 0 for no limit")
+			("session-burst", po::value(&options.session_burst)->default_value(options.session_burst),
+			 "Burst size in bytes of the per session rate limit")
+			("user-rate", po::value(&options.user_rate)->default_value(options.user_rate),
+			 "Bytes per second allowed for all the sessions of a client_id, 0 for no limit")
+			("user-burst", po::value(&options.user_burst)->default_value(options.user_burst),
+			 "Burst size in bytes of the per user rate limit");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if(vm.count("help"))
+		{
+			std::cout << desc << "\n";
+			return 0;
+		}
+		options.log_traffic = vm.count("quiet") == 0;
+		options.journal_segment_size = vm["journal-segment-mb"].as<size_t>() << 20;
+		options.journal_buffer_size = vm["journal-buffer-mb"].as<size_t>() << 20;
+		options.journal_fsync_interval = std::chrono::milliseconds(vm["journal-fsync-ms"].as<long>());
+		if(vm.count("legacy-cipher"))
+		{
+			options.features &= ~FEATURE_CHACHA20;
+		}
+
+		if(vm.count("takeover") && handoff_socket.empty())
+		{
+			std::cerr << "--takeover needs the --handoff-socket of the running server\n";
+			return 1;
+		}
+
 		boost::asio::io_context io_context;
 
-		session_manager s(io_context);
+		std::unique_ptr<session_manager> manager;
+		std::unique_ptr<handoff_listener> handoff;
+		auto stop = [&io_context]() { io_context.stop(); };
+		if(vm.count("takeover"))
+		{
+			// Everything that can fail comes before the old server lets go of anything
+			auto context = std::make_shared<server_context>(options);
+			handoff = std::make_unique<handoff_listener>(io_context, handoff_socket, stop, true);
+			manager = take_over(io_context, std::move(context), handoff_socket);
+			handoff->publish();
+		}
+		else
+		{
+			manager = std::make_unique<session_manager>(io_context, options);
+			if(!handoff_socket.empty())
+			{
+				handoff = std::make_unique<handoff_listener>(io_context, handoff_socket, stop);
+			}
+		}
+		if(handoff)
+		{
+			handoff->start(*manager);
+		}
+
+		// Stop cleanly so the journal gets synced and trimmed
+		boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+		signals.async_wait([&io_context](const boost::system::error_code&, int) { io_context.stop(); });
 
+		std::vector<std::thread> threads;
+		for(size_t i = 1; i < options.threads; ++i)
+		{
+			threads.emplace_back([&io_context]() { io_context.run(); });
+		}
 		io_context.run();
+		for(auto& t : threads)
+		{
+			t.join();
+		}
+
+		if(const journal* echo_journal = manager->context().echo_journal.get())
+		{
+			std::cerr << "Journal: " << echo_journal->records() << " records, " << echo_journal->dropped()
+					  << " dropped\n";
+		}
+
+#ifdef ECHO_TRACING
+		if(!trace_file.empty() && !trace::write_chrome_trace(trace_file))
+		{
+			std::cerr << "Can't write the trace to " << trace_file << "\n";
+		}
+#endif
 	}
 	catch(std::exception& e)
 	{
@@ -16,4 +133,4 @@ int main(int argc, char* argv[])
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
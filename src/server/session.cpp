@@ -1,56 +1,386 @@
 #include "server/session.h"
 #include "utils/crypto.hpp"
+#include "utils/memory_stream.hpp"
+
+#include <algorithm>
+#include <random>
+#include <type_traits>
 
 using boost::asio::ip::tcp;
 
-session::session(tcp::socket socket)
-	: socket_(std::move(socket))
+template <typename Stream>
+basic_session<Stream>::basic_session(Stream stream, std::shared_ptr<server_context> context)
+	: stream_(std::move(stream))
+	, context_(std::move(context))
+	, throttle_timer_(stream_.get_executor())
+	, read_buffer_(read_buffer_size)
+	, session_bucket_(context_->options.session_rate, context_->options.session_burst)
 	, client_id("default")
 { }
 
-void session::start()
+template <typename Stream>
+basic_session<Stream>::~basic_session()
 {
-	do_read_header();
+	if(handoff_)
+	{
+		handoff_(session_handoff{});
+	}
+	if(logged_in_)
+	{
+		context_->registry.unbind_client(id_, client_id);
+	}
+	if(id_ != 0)
+	{
+		context_->registry.remove(id_);
+	}
+}
+
+template <typename Stream>
+void basic_session<Stream>::start()
+{
+	id_ = context_->registry.add(weak_from_this());
+	start_turn();
 }
 
-void session::do_read_header()
+template <typename Stream>
+void basic_session<Stream>::resume(session_handoff state)
+{
+	id_ = context_->registry.add(weak_from_this());
+
+	client_id = std::move(state.client_id);
+	logged_in_ = state.logged_in;
+	username_sum_ = state.username_sum;
+	password_sum_ = state.password_sum;
+	broadcast_seq_ = state.broadcast_seq;
+	features_ = state.features;
+	chacha_key_ = state.chacha_key;
+
+	if(logged_in_)
+	{
+		user_bucket_ = context_->limiter.user_bucket(client_id);
+		context_->registry.bind_client(id_, client_id);
+	}
+
+	// Never more than one read buffer was left, the old server used the same size
+	size_t input_size = std::min(state.input.size(), read_buffer_.size());
+	std::memcpy(read_buffer_.data(), state.input.data(), input_size);
+	read_end_ = input_size;
+	write_buffer_ = std::move(state.output);
+	captured_prefix_ = std::min(state.captured_size, write_buffer_.size());
+
+	start_turn();
+}
+
+template <typename Stream>
+void basic_session<Stream>::hand_off(session_handoff_handler handler,
+									 std::chrono::steady_clock::duration write_timeout)
 {
 	auto self(shared_from_this());
-	boost::asio::async_read(socket_,
-							boost::asio::buffer(&in_header_, sizeof(PacketHeader)),
-							[this, self](boost::system::error_code ec, std::size_t length) {
-								if(!ec && length == sizeof(PacketHeader))
-								{
-									in_header_.msg_size = ntohs(in_header_.msg_size);
+	boost::asio::post(stream_.get_executor(), [this, self, handler = std::move(handler), write_timeout]() mutable {
+		if constexpr(!std::is_same_v<Stream, tcp::socket>)
+		{
+			handler(session_handoff{});
+			return;
+		}
+		else
+		{
+			if(handed_off_ || handoff_)
+			{
+				handler(session_handoff{});
+				return;
+			}
+			handoff_ = std::move(handler);
+
+			// The read is cancelled once the write in flight completed, cancel() would abort both
+			throttle_timer_.cancel();
+			if(reading_ && !writing_)
+			{
+				stream_.cancel();
+			}
+			else if(writing_)
+			{
+				// A client that stopped reading never lets the write complete, the bytes
+				// it didn't get are handed off instead
+				throttle_timer_.expires_after(write_timeout);
+				throttle_timer_.async_wait([this, self](boost::system::error_code ec) {
+					if(!ec && handoff_ && writing_)
+					{
+						stream_.cancel();
+					}
+				});
+			}
+			complete_handoff();
+		}
+	});
+}
+
+template <typename Stream>
+void basic_session<Stream>::complete_handoff()
+{
+	if constexpr(std::is_same_v<Stream, tcp::socket>)
+	{
+		if(!handoff_ || reading_ || writing_)
+		{
+			return;
+		}
+
+		throttle_timer_.cancel();
+
+		session_handoff state;
+		state.client_id = client_id;
+		state.logged_in = logged_in_;
+		state.username_sum = username_sum_;
+		state.password_sum = password_sum_;
+		state.broadcast_seq = broadcast_seq_;
+		state.features = features_;
+		state.chacha_key = chacha_key_;
+		state.input.assign(read_buffer_.data() + read_begin_, read_buffer_.data() + read_end_);
+
+		// The pending broadcasts become plain bytes after the responses
+		state.output = std::move(write_buffer_);
+		state.captured_size = captured_prefix_;
+		for(const broadcast_item& item : broadcasts_)
+		{
+			const char* header = reinterpret_cast<const char*>(&item.header);
+			state.output.insert(state.output.end(), header, header + sizeof(PacketHeader));
+			state.output.insert(state.output.end(), item.payload->begin(), item.payload->end());
+		}
+		broadcasts_.clear();
+
+		boost::system::error_code ec;
+		state.fd = stream_.release(ec);
+		if(ec)
+		{
+			state.fd = -1;
+		}
+
+		handed_off_ = true;
+		auto handler = std::move(handoff_);
+		handoff_ = nullptr;
+		handler(std::move(state));
+	}
+}
+
+template <typename Stream>
+void basic_session<Stream>::keep_unsent(size_t written)
+{
+	std::vector<char> unsent;
+	for(const boost::asio::const_buffer& buffer : write_buffers_)
+	{
+		size_t skipped = std::min(written, buffer.size());
+		written -= skipped;
+		const char* data = static_cast<const char*>(buffer.data());
+		unsent.insert(unsent.end(), data + skipped, data + buffer.size());
+	}
+
+	// Already captured when the write started, unlike the responses queued since
+	captured_prefix_ = unsent.size();
+	unsent.insert(unsent.end(), write_buffer_.begin(), write_buffer_.end());
+	write_buffer_ = std::move(unsent);
+
+	writing_buffer_.clear();
+	writing_broadcasts_.clear();
+}
+
+template <typename Stream>
+void basic_session<Stream>::deliver(std::shared_ptr<const std::vector<char>> payload)
+{
+	auto self(shared_from_this());
+	boost::asio::post(stream_.get_executor(), [this, self, payload = std::move(payload)]() mutable {
+		if(!logged_in_ || handed_off_)
+		{
+			return;
+		}
+
+		// A client that doesn't read its broadcasts must not grow the server's memory
+		if(broadcasts_.size() >= max_broadcast_backlog)
+		{
+			if(dropped_broadcasts_++ == 0)
+			{
+				std::cerr << "Dropping broadcasts for slow client: " << client_id << "\n";
+			}
+			return;
+		}
+
+		broadcast_item item;
+		item.header.msg_type = BROADCAST_MESSAGE;
+		item.header.msg_seq = broadcast_seq_++;
+		item.header.msg_size = htons(static_cast<uint16_t>(sizeof(PacketHeader) + payload->size()));
+		item.payload = std::move(payload);
+		broadcasts_.push_back(std::move(item));
+
+		send_packets();
+	});
+}
+
+template <typename Stream>
+void basic_session<Stream>::do_read_header()
+{
+	if(read_end_ - read_begin_ < sizeof(PacketHeader))
+	{
+		do_read_more();
+		return;
+	}
+
+	std::memcpy(&in_header_, read_buffer_.data() + read_begin_, sizeof(PacketHeader));
+	in_header_.msg_size = ntohs(in_header_.msg_size);
 
-									if(in_header_.msg_size > max_length)
-									{
-										std::cerr << "Invalid header size: "
-												  << static_cast<int>(in_header_.msg_size) << "\n";
-										return;
-									}
+	if(in_header_.msg_size > max_length || in_header_.msg_size < sizeof(PacketHeader))
+	{
+		std::cerr << "Invalid header size: " << static_cast<int>(in_header_.msg_size) << "\n";
+		return;
+	}
 
-									do_read_body();
-								}
-							});
+	do_read_body();
 }
 
-void session::do_read_body()
+template <typename Stream>
+void basic_session<Stream>::do_read_body()
 {
+	if(read_end_ - read_begin_ < in_header_.msg_size)
+	{
+		do_read_more();
+		return;
+	}
+
+	in_body_ = read_buffer_.data() + read_begin_ + sizeof(PacketHeader);
+	in_body_size_ = in_header_.msg_size - sizeof(PacketHeader);
+
+	if(context_->capture)
+	{
+		context_->capture->record(id_, CLIENT_TO_SERVER, read_buffer_.data() + read_begin_, in_header_.msg_size);
+	}
+
+	{
+		TRACE_SPAN("handle_packet", id_);
+		handle_packet();
+	}
+
+	read_begin_ += in_header_.msg_size;
+	next_frame(in_header_.msg_size);
+}
+
+template <typename Stream>
+void basic_session<Stream>::do_read_more()
+{
+	if(!write_buffer_.empty())
+	{
+		flush_waiting_ = true;
+		send_packets();
+		return;
+	}
+
+	// Move the partial frame to the front so a whole frame always fits
+	if(read_begin_ > 0)
+	{
+		std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+		read_end_ -= read_begin_;
+		read_begin_ = 0;
+	}
+
 	auto self(shared_from_this());
-	in_body_.resize(in_header_.msg_size - sizeof(PacketHeader));
+	TRACE_START(read_started_);
+	reading_ = true;
+	stream_.async_read_some(
+		boost::asio::buffer(read_buffer_.data() + read_end_, read_buffer_.size() - read_end_),
+		[this, self](boost::system::error_code ec, std::size_t length) {
+			reading_ = false;
+			if(!ec)
+			{
+				TRACE_END("read", read_started_, id_);
+				read_end_ += length;
+				start_turn();
+			}
+			else if(handoff_)
+			{
+				complete_handoff();
+			}
+		});
+}
+
+template <typename Stream>
+void basic_session<Stream>::next_frame(size_t frame_size)
+{
+	++turn_frames_;
+	turn_bytes_ += frame_size;
 
-	boost::asio::async_read(socket_,
-							boost::asio::buffer(in_body_),
-							[this, self](boost::system::error_code ec, std::size_t length) {
-								if(!ec)
-								{
-									handle_packet();
-								}
-							});
+	auto now = token_bucket::clock::now();
+	session_bucket_.consume(frame_size, now);
+	if(user_bucket_)
+	{
+		user_bucket_->consume(frame_size, now);
+	}
+
+	const server_options& options = context_->options;
+	bool turn_over = (options.frames_per_turn != 0 && turn_frames_ >= options.frames_per_turn) ||
+					 (options.bytes_per_turn != 0 && turn_bytes_ >= options.bytes_per_turn);
+
+	if(turn_over || throttle_delay() > token_bucket::clock::duration::zero())
+	{
+		end_turn();
+		return;
+	}
+
+	do_read_header();
 }
 
-void session::handle_packet()
+template <typename Stream>
+void basic_session<Stream>::end_turn()
+{
+	if(!write_buffer_.empty())
+	{
+		flush_waiting_ = true;
+		send_packets();
+		return;
+	}
+
+	auto self(shared_from_this());
+	boost::asio::post(stream_.get_executor(), [this, self]() { start_turn(); });
+}
+
+template <typename Stream>
+void basic_session<Stream>::start_turn()
+{
+	if(handoff_ || handed_off_)
+	{
+		complete_handoff();
+		return;
+	}
+
+	turn_frames_ = 0;
+	turn_bytes_ = 0;
+
+	auto delay = throttle_delay();
+	if(delay > token_bucket::clock::duration::zero())
+	{
+		auto self(shared_from_this());
+		throttle_timer_.expires_after(delay);
+		throttle_timer_.async_wait([this, self](boost::system::error_code ec) {
+			if(!ec)
+			{
+				start_turn();
+			}
+		});
+		return;
+	}
+
+	do_read_header();
+}
+
+template <typename Stream>
+token_bucket::clock::duration basic_session<Stream>::throttle_delay()
+{
+	auto now = token_bucket::clock::now();
+	auto delay = session_bucket_.delay(now);
+	if(user_bucket_)
+	{
+		delay = std::max(delay, user_bucket_->delay(now));
+	}
+	return delay;
+}
+
+template <typename Stream>
+void basic_session<Stream>::handle_packet()
 {
 	switch(in_header_.msg_type)
 	{
@@ -60,29 +390,63 @@ void session::handle_packet()
 	case ECHO_REQUEST:
 		handle_echo();
 		break;
+	case BROADCAST_REQUEST:
+		handle_broadcast();
+		break;
 	default:
 		std::cerr << "Unknown message type: " << static_cast<int>(in_header_.msg_type) << "\n";
 		break;
 	}
 }
 
-void session::handle_login()
+template <typename Stream>
+void basic_session<Stream>::handle_login()
 {
-	if(in_body_.size() < sizeof(LoginRequest) - sizeof(PacketHeader))
+	if(in_body_size_ < sizeof(LoginRequest) - sizeof(PacketHeader))
 	{
-		std::cerr << "Invalid login request size: " << in_body_.size() << "\n";
+		std::cerr << "Invalid login request size: " << in_body_size_ << "\n";
 		return;
 	}
 
-	const char* username_data = in_body_.data();
-	const char* password_data = in_body_.data() + 28;
-	std::string username(username_data, 28);
-	std::string password(password_data, 4);
+	const char* username_data = in_body_;
+	const char* password_data = in_body_ + 28;
+	std::string username(username_data, strnlen(username_data, 28));
+	std::string password(password_data, strnlen(password_data, 4));
+	if(logged_in_)
+	{
+		context_->registry.unbind_client(id_, client_id);
+	}
 	client_id = username;
+	user_bucket_ = context_->limiter.user_bucket(client_id);
 
 	username_sum_ = compute_checksum_cstr(username_data, 28);
 	password_sum_ = compute_checksum_cstr(password_data, 4);
 
+	// Legacy clients stop after the password, newer ones append their capabilities
+	const size_t capabilities_offset = sizeof(LoginRequest) - sizeof(PacketHeader);
+	bool negotiated = in_body_size_ >= capabilities_offset + sizeof(LoginCapabilities);
+	LoginCapabilities capabilities{};
+	features_ = 0;
+
+	if(negotiated)
+	{
+		std::memcpy(&capabilities, in_body_ + capabilities_offset, sizeof(LoginCapabilities));
+		uint16_t version = std::min<uint16_t>(ntohs(capabilities.version), PROTOCOL_VERSION);
+		features_ = ntohl(capabilities.features) & protocol_features(version) & context_->options.features;
+
+		thread_local std::mt19937 generator{std::random_device{}()};
+		uint32_t server_nonce = generator();
+		if(features_ & FEATURE_CHACHA20)
+		{
+			chacha_key_ = derive_chacha20_key(
+				username_sum_, password_sum_, ntohl(capabilities.nonce), server_nonce);
+		}
+
+		capabilities.version = htons(version);
+		capabilities.features = htonl(features_);
+		capabilities.nonce = htonl(server_nonce);
+	}
+
 	LoginResponse response;
 	response.header.msg_type = LOGIN_RESPONSE;
 	response.header.msg_seq = in_header_.msg_seq;
@@ -96,72 +460,248 @@ void session::handle_login()
 	else
 	{
 		response.status_code = 1;
-		std::cout << "User: " << username << " has logged on\n";
+		logged_in_ = true;
+		context_->registry.bind_client(id_, client_id);
+		if(context_->options.log_traffic)
+		{
+			std::cout << "User: " << username << " has logged on\n";
+		}
 	}
 
-	response.header.msg_size = htons(sizeof(LoginResponse));
+	uint16_t total_size = sizeof(LoginResponse) + (negotiated ? sizeof(LoginCapabilities) : 0);
+	response.header.msg_size = htons(total_size);
 	response.status_code = htons(response.status_code);
 
-	auto buffer = std::make_shared<std::array<char, sizeof(LoginResponse)>>();
-
-	memcpy(buffer->data(), &response, sizeof(LoginResponse));
-
-	send_packet(buffer, sizeof(LoginResponse));
+	queue_packet(&response, sizeof(LoginResponse));
+	if(negotiated)
+	{
+		queue_packet(&capabilities, sizeof(LoginCapabilities));
+	}
 }
 
-void session::handle_echo()
+template <typename Stream>
+bool basic_session<Stream>::decrypt_payload(std::vector<uint8_t>& plain_text)
 {
-	uint16_t payload_len = ntohs(*reinterpret_cast<const uint16_t*>(in_body_.data()));
+	if(in_body_size_ < sizeof(uint16_t))
+	{
+		std::cerr << "Invalid request size: " << in_body_size_ << "\n";
+		return false;
+	}
+
+	uint16_t payload_len;
+	std::memcpy(&payload_len, in_body_, sizeof(uint16_t));
+	payload_len = ntohs(payload_len);
 
-	if(payload_len > in_body_.size() - sizeof(uint16_t))
+	if(payload_len > in_body_size_ - sizeof(uint16_t))
 	{
-		std::cerr << "Invalid echo request size: " << payload_len << "\n";
-		return;
+		std::cerr << "Invalid request size: " << payload_len << "\n";
+		return false;
 	}
 
-	const std::string cipher = reinterpret_cast<const char*>(in_body_.data() + sizeof(uint16_t));
-	std::cout << "Ciphered payload from "<< client_id << ": ";
-	print_string_as_hex(cipher);
+	TRACE_SPAN("decrypt", id_);
+	const char* cipher = in_body_ + sizeof(uint16_t);
+	if(context_->options.log_traffic)
+	{
+		std::cout << "Ciphered payload from " << client_id << ": ";
+		print_string_as_hex(std::string(cipher, payload_len));
+	}
+
+	if(features_ & FEATURE_CHACHA20)
+	{
+		plain_text = chacha20_operation(payload_len, chacha_key_, in_header_.msg_seq, cipher);
+		return true;
+	}
 
 	uint32_t key_state = compute_initial_key(static_cast<uint32_t>(in_header_.msg_seq),
 											 static_cast<uint32_t>(username_sum_),
 											 static_cast<uint32_t>(password_sum_));
-	std::vector<uint8_t> decrypted = xor_operation(payload_len, key_state, cipher);
-	std::string plain_text(decrypted.begin(), decrypted.end());
+	plain_text = xor_operation(payload_len, key_state, cipher);
+	return true;
+}
 
-	std::cout << client_id << " sent message: " << plain_text << "\n";
+template <typename Stream>
+void basic_session<Stream>::handle_echo()
+{
+	std::vector<uint8_t> decrypted;
+	if(!decrypt_payload(decrypted))
+	{
+		return;
+	}
 
+	if(context_->options.log_traffic)
+	{
+		std::cout << client_id << " sent message: "
+				  << std::string(decrypted.begin(), decrypted.end()) << "\n";
+	}
+
+	if(context_->echo_journal)
+	{
+		TRACE_SPAN("journal", id_);
+		context_->echo_journal->append(client_id, in_header_.msg_seq, decrypted.data(), decrypted.size());
+	}
+
+	TRACE_SPAN("response", id_);
 	EchoResponse response_header;
 	response_header.header.msg_type = ECHO_RESPONSE;
 	response_header.header.msg_seq = in_header_.msg_seq;
-	response_header.msg_size = htons(static_cast<uint16_t>(plain_text.size()));
+	response_header.msg_size = htons(static_cast<uint16_t>(decrypted.size()));
 
-	uint16_t total_size = sizeof(EchoResponse) + plain_text.size();
+	uint16_t total_size = sizeof(EchoResponse) + decrypted.size();
 	response_header.header.msg_size = htons(total_size);
 
-	auto buffer = std::make_shared<std::vector<char>>();
-	buffer->reserve(total_size);
+	queue_packet(&response_header, sizeof(EchoResponse));
+	queue_packet(decrypted.data(), decrypted.size());
+}
+
+template <typename Stream>
+void basic_session<Stream>::handle_broadcast()
+{
+	if(!logged_in_)
+	{
+		std::cerr << "Broadcast before login from: " << client_id << "\n";
+		return;
+	}
+
+	std::vector<uint8_t> decrypted;
+	if(!decrypt_payload(decrypted))
+	{
+		return;
+	}
+
+	std::string text = client_id + ": ";
+	text.append(decrypted.begin(), decrypted.end());
+	text.resize(std::min(text.size(), max_length - sizeof(BroadcastMessage)));
+
+	if(context_->options.log_traffic)
+	{
+		std::cout << "Broadcast from " << text << "\n";
+	}
 
-	buffer->insert(buffer->end(),
-				   reinterpret_cast<char*>(&response_header),
-				   reinterpret_cast<char*>(&response_header) + sizeof(EchoResponse));
+	// Serialized once, every recipient only adds its own header in front of it
+	auto payload = std::make_shared<std::vector<char>>();
+	payload->reserve(sizeof(uint16_t) + text.size());
+	uint16_t text_size = htons(static_cast<uint16_t>(text.size()));
+	payload->insert(payload->end(),
+					reinterpret_cast<const char*>(&text_size),
+					reinterpret_cast<const char*>(&text_size) + sizeof(uint16_t));
+	payload->insert(payload->end(), text.begin(), text.end());
 
-	buffer->insert(buffer->end(), plain_text.begin(), plain_text.end());
+	std::shared_ptr<const std::vector<char>> shared_payload = std::move(payload);
+	context_->registry.for_each(
+		[&shared_payload](const std::shared_ptr<session_base>& s) { s->deliver(shared_payload); });
+}
+
+template <typename Stream>
+void basic_session<Stream>::queue_packet(const void* data, size_t length)
+{
+	const char* bytes = static_cast<const char*>(data);
+	write_buffer_.insert(write_buffer_.end(), bytes, bytes + length);
+}
+
+template <typename Stream>
+void basic_session<Stream>::capture_writes()
+{
+	size_t offset = captured_prefix_;
+	while(offset + sizeof(PacketHeader) <= writing_buffer_.size())
+	{
+		PacketHeader header;
+		std::memcpy(&header, writing_buffer_.data() + offset, sizeof(PacketHeader));
+		size_t frame_size = std::min<size_t>(ntohs(header.msg_size), writing_buffer_.size() - offset);
+		if(frame_size < sizeof(PacketHeader))
+		{
+			break;
+		}
+		context_->capture->record(id_, SERVER_TO_CLIENT, writing_buffer_.data() + offset, frame_size);
+		offset += frame_size;
+	}
 
-	send_packet(buffer, total_size);
+	for(const broadcast_item& item : writing_broadcasts_)
+	{
+		context_->capture->record(id_,
+								  SERVER_TO_CLIENT,
+								  &item.header,
+								  sizeof(PacketHeader),
+								  item.payload->data(),
+								  item.payload->size());
+	}
 }
 
-template <typename buffer_T>
-void session::send_packet(std::shared_ptr<buffer_T> buffer, size_t length)
+template <typename Stream>
+void basic_session<Stream>::send_packets()
 {
+	if(writing_ || handoff_ || handed_off_ || (write_buffer_.empty() && broadcasts_.empty()))
+	{
+		return;
+	}
+	writing_ = true;
+
+	// The responses of the turn keep accumulating in write_buffer_ while this one is written
+	std::swap(write_buffer_, writing_buffer_);
+
+	write_buffers_.clear();
+	if(!writing_buffer_.empty())
+	{
+		write_buffers_.push_back(boost::asio::buffer(writing_buffer_));
+	}
+
+	while(!broadcasts_.empty() && writing_broadcasts_.size() < max_broadcasts_per_write)
+	{
+		writing_broadcasts_.push_back(std::move(broadcasts_.front()));
+		broadcasts_.pop_front();
+	}
+	for(const broadcast_item& item : writing_broadcasts_)
+	{
+		write_buffers_.push_back(boost::asio::buffer(&item.header, sizeof(PacketHeader)));
+		write_buffers_.push_back(boost::asio::buffer(*item.payload));
+	}
+
+	if(context_->capture)
+	{
+		capture_writes();
+	}
+	captured_prefix_ = 0;
+
 	auto self(shared_from_this());
-	boost::asio::async_write(
-		socket_,
-		boost::asio::buffer(*buffer, length),
-		[this, self, buffer](boost::system::error_code ec, std::size_t length) {
-			if(!ec)
-			{
-				do_read_header();
-			}
-		});
+	TRACE_START(write_started_);
+	boost::asio::async_write(stream_,
+							 write_buffers_,
+							 [this, self](boost::system::error_code ec, std::size_t length) {
+								 writing_ = false;
+								 if(!ec)
+								 {
+									 writing_buffer_.clear();
+									 writing_broadcasts_.clear();
+								 }
+								 else if(handoff_)
+								 {
+									 keep_unsent(length);
+								 }
+								 if(handoff_)
+								 {
+									 if(reading_)
+									 {
+										 if constexpr(std::is_same_v<Stream, tcp::socket>)
+										 {
+											 stream_.cancel();
+										 }
+									 }
+									 complete_handoff();
+									 return;
+								 }
+								 if(ec)
+								 {
+									 return;
+								 }
+								 TRACE_END("write", write_started_, id_);
+
+								 if(flush_waiting_ && write_buffer_.empty())
+								 {
+									 flush_waiting_ = false;
+									 start_turn();
+								 }
+								 send_packets();
+							 });
 }
+
+template class basic_session<tcp::socket>;
+template class basic_session<memory_stream>;
@@ -1,22 +1,110 @@
 #include "server/session_manager.h"
 
+#include <future>
+#include <unistd.h>
+
 using boost::asio::ip::tcp;
 
-session_manager::session_manager(boost::asio::io_context& io_context)
-	: acceptor_(io_context, tcp::endpoint(tcp::v4(), 12345))
+session_manager::session_manager(boost::asio::io_context& io_context, const server_options& options)
+	: io_context_(io_context)
+	, acceptor_(boost::asio::make_strand(io_context), tcp::endpoint(tcp::v4(), options.port))
+	, context_(std::make_shared<server_context>(options))
+{
+	do_accept();
+}
+
+session_manager::session_manager(boost::asio::io_context& io_context,
+								 std::shared_ptr<server_context> context,
+								 tcp::acceptor::native_handle_type listener)
+	: io_context_(io_context)
+	, acceptor_(boost::asio::make_strand(io_context), tcp::v4(), listener)
+	, context_(std::move(context))
 {
 	do_accept();
 }
 
+uint16_t session_manager::port() const
+{
+	return acceptor_.local_endpoint().port();
+}
+
+tcp::acceptor::native_handle_type session_manager::release_listener()
+{
+	std::promise<tcp::acceptor::native_handle_type> released;
+	boost::asio::post(acceptor_.get_executor(), [this, &released]() {
+		boost::system::error_code ec;
+		tcp::acceptor::native_handle_type listener = acceptor_.release(ec);
+		released.set_value(ec ? -1 : listener);
+	});
+	return released.get_future().get();
+}
+
+void session_manager::restore_listener(tcp::acceptor::native_handle_type listener)
+{
+	boost::asio::post(acceptor_.get_executor(), [this, listener]() {
+		boost::system::error_code ec;
+		acceptor_.assign(tcp::v4(), listener, ec);
+		if(ec)
+		{
+			std::cerr << "Failed to listen again after the handoff: " << ec.message() << "\n";
+			::close(listener);
+			return;
+		}
+		do_accept();
+	});
+}
+
+size_t session_manager::hand_off_sessions(const session_handoff_handler& handler,
+										  std::chrono::steady_clock::duration write_timeout)
+{
+	std::vector<std::shared_ptr<session_base>> sessions;
+	sessions.reserve(context_->registry.size());
+	context_->registry.for_each([&sessions](const std::shared_ptr<session_base>& s) { sessions.push_back(s); });
+
+	for(const auto& s : sessions)
+	{
+		s->hand_off(handler, write_timeout);
+	}
+	return sessions.size();
+}
+
+bool session_manager::adopt_session(session_handoff state)
+{
+	boost::asio::any_io_executor strand = boost::asio::make_strand(io_context_);
+	tcp::socket socket(strand);
+	boost::system::error_code ec;
+	socket.assign(tcp::v4(), state.fd, ec);
+	if(ec)
+	{
+		::close(state.fd);
+		return false;
+	}
+
+	// Started on its strand, the io threads may be serving the other sessions already
+	auto s = std::make_shared<session>(std::move(socket), context_);
+	boost::asio::post(strand, [s, state = std::move(state)]() mutable { s->resume(std::move(state)); });
+	return true;
+}
+
 void session_manager::do_accept()
 {
-	/// When succesfull it provides the socket and starts the session
-	acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+	/// When succesfull it provides the socket and starts the session, every
+	/// session gets its own strand so the io_context can run on many threads
+	boost::asio::any_io_executor strand = boost::asio::make_strand(io_context_);
+	acceptor_.async_accept(strand, [this](boost::system::error_code ec, tcp::socket socket) {
 		if(!ec)
 		{
-			std::make_shared<session>(std::move(socket))->start();
+			// A turn's responses go out as one write, Nagle would hold back the next one
+			boost::system::error_code option_ec;
+			socket.set_option(tcp::no_delay(true), option_ec);
+			std::make_shared<session>(std::move(socket), context_)->start();
 		}
 
+		// The listening socket was handed off
+		if(!acceptor_.is_open())
+		{
+			return;
+		}
 		do_accept();
 	});
 }
@@ -0,0 +1,98 @@
+#include "server/session_registry.h"
+
+#include <functional>
+
+uint64_t session_registry::add(std::weak_ptr<session_base> s)
+{
+	uint64_t id = next_id_.fetch_add(1, std::memory_order_relaxed);
+
+	id_shard& shard = shard_for(id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.sessions.emplace(id, std::move(s));
+	return id;
+}
+
+void session_registry::remove(uint64_t id)
+{
+	id_shard& shard = shard_for(id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.sessions.erase(id);
+}
+
+void session_registry::bind_client(uint64_t id, const std::string& client_id)
+{
+	client_shard& shard = shard_for(client_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.clients.emplace(client_id, id);
+}
+
+void session_registry::unbind_client(uint64_t id, const std::string& client_id)
+{
+	client_shard& shard = shard_for(client_id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto range = shard.clients.equal_range(client_id);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(it->second == id)
+		{
+			shard.clients.erase(it);
+			return;
+		}
+	}
+}
+
+std::shared_ptr<session_base> session_registry::find(uint64_t id) const
+{
+	const id_shard& shard = shard_for(id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.sessions.find(id);
+	return it != shard.sessions.end() ? it->second.lock() : nullptr;
+}
+
+std::vector<std::shared_ptr<session_base>> session_registry::find_client(const std::string& client_id) const
+{
+	std::vector<uint64_t> ids;
+	{
+		const client_shard& shard = shard_for(client_id);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		auto range = shard.clients.equal_range(client_id);
+		for(auto it = range.first; it != range.second; ++it)
+		{
+			ids.push_back(it->second);
+		}
+	}
+
+	std::vector<std::shared_ptr<session_base>> sessions;
+	for(uint64_t id : ids)
+	{
+		if(auto s = find(id))
+		{
+			sessions.push_back(std::move(s));
+		}
+	}
+	return sessions;
+}
+
+size_t session_registry::size() const
+{
+	size_t total = 0;
+	for(const id_shard& shard : id_shards_)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		total += shard.sessions.size();
+	}
+	return total;
+}
+
+session_registry::client_shard& session_registry::shard_for(const std::string& client_id)
+{
+	return client_shards_[std::hash<std::string>{}(client_id) % shard_count];
+}
+
+const session_registry::client_shard& session_registry::shard_for(const std::string& client_id) const
+{
+	return client_shards_[std::hash<std::string>{}(client_id) % shard_count];
+}
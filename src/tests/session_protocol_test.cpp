@@ -0,0 +1,296 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "server/session.h"
+#include "utils/crypto.hpp"
+#include "utils/memory_stream.hpp"
+
+/// Drives one basic_session over a memory_stream, every step runs the
+/// io_context until the session has nothing left to do.
+class test_bed
+{
+public:
+	explicit test_bed(const server_options& options = quiet_options())
+		: context_(std::make_shared<server_context>(options))
+		, client_(init(io_context_, context_))
+	{
+		read_loop();
+		settle();
+	}
+
+	~test_bed()
+	{
+		client_.close();
+		settle();
+	}
+
+	/// @brief Writes raw bytes to the session and lets it handle them.
+	void send(const std::vector<char>& bytes)
+	{
+		auto copy = std::make_shared<std::vector<char>>(bytes);
+		boost::asio::async_write(client_, boost::asio::buffer(*copy), [copy](boost::system::error_code, size_t) {});
+		settle();
+	}
+
+	/// @brief Sends a login, with capabilities when version is not 0.
+	void login(uint16_t version = 0, uint32_t features = 0)
+	{
+		send(login_frame(version, features));
+	}
+
+	/// @brief Builds the login request, the following echoes are ciphered with its checksums.
+	std::vector<char> login_frame(uint16_t version = 0, uint32_t features = 0)
+	{
+		LoginRequest login{};
+		login.header.msg_type = LOGIN_REQUEST;
+		login.header.msg_seq = 0;
+		login.header.msg_size = htons(static_cast<uint16_t>(
+			sizeof(LoginRequest) + (version != 0 ? sizeof(LoginCapabilities) : 0)));
+		std::strncpy(login.username, "tester", sizeof(login.username));
+		std::strncpy(login.password, "pass", sizeof(login.password));
+		username_sum_ = compute_checksum_cstr(login.username, sizeof(login.username));
+		password_sum_ = compute_checksum_cstr(login.password, sizeof(login.password));
+
+		std::vector<char> frame = bytes_of(login);
+		if(version != 0)
+		{
+			LoginCapabilities capabilities;
+			capabilities.version = htons(version);
+			capabilities.features = htonl(features);
+			capabilities.nonce = htonl(42);
+			std::vector<char> extra = bytes_of(capabilities);
+			frame.insert(frame.end(), extra.begin(), extra.end());
+		}
+		return frame;
+	}
+
+	/// @brief Builds an echo request ciphered with the LCG.
+	/// @param declared_size The payload length written in the request, the real one when 0
+	std::vector<char> echo_frame(uint8_t seq, const std::string& message, uint16_t declared_size = 0)
+	{
+		EchoRequest request{};
+		request.header.msg_type = ECHO_REQUEST;
+		request.header.msg_seq = seq;
+		request.header.msg_size = htons(static_cast<uint16_t>(sizeof(EchoRequest) + message.size()));
+		request.msg_size = htons(declared_size != 0 ? declared_size : static_cast<uint16_t>(message.size()));
+
+		uint32_t key_state = compute_initial_key(seq, username_sum_, password_sum_);
+		std::vector<uint8_t> cipher = xor_operation(static_cast<uint16_t>(message.size()), key_state, message);
+
+		std::vector<char> frame = bytes_of(request);
+		frame.insert(frame.end(), cipher.begin(), cipher.end());
+		return frame;
+	}
+
+	/// @brief Pops the next whole frame the session sent, false if there is none.
+	bool next_frame(PacketHeader& header, std::string& body)
+	{
+		if(received_.size() < sizeof(PacketHeader))
+		{
+			return false;
+		}
+		std::memcpy(&header, received_.data(), sizeof(PacketHeader));
+		header.msg_size = ntohs(header.msg_size);
+		if(header.msg_size < sizeof(PacketHeader) || received_.size() < header.msg_size)
+		{
+			return false;
+		}
+		body.assign(received_.data() + sizeof(PacketHeader), header.msg_size - sizeof(PacketHeader));
+		received_.erase(received_.begin(), received_.begin() + header.msg_size);
+		return true;
+	}
+
+	/// @brief Returns true once the session closed the stream.
+	bool closed() const { return eof_; }
+
+private:
+	boost::asio::io_context io_context_;
+	std::shared_ptr<server_context> context_;
+	memory_stream client_;
+	std::vector<char> received_;
+	std::array<char, 1024> read_buffer_;
+	bool eof_{false};
+	uint8_t username_sum_{0};
+	uint8_t password_sum_{0};
+
+	static server_options quiet_options()
+	{
+		server_options options;
+		options.log_traffic = false;
+		return options;
+	}
+
+	static memory_stream init(boost::asio::io_context& io_context, const std::shared_ptr<server_context>& context)
+	{
+		auto streams = memory_stream::make_pair(io_context.get_executor());
+		std::make_shared<basic_session<memory_stream>>(std::move(streams.first), context)->start();
+		return std::move(streams.second);
+	}
+
+	template <typename T>
+	static std::vector<char> bytes_of(const T& value)
+	{
+		const char* raw = reinterpret_cast<const char*>(&value);
+		return std::vector<char>(raw, raw + sizeof(T));
+	}
+
+	void read_loop()
+	{
+		client_.async_read_some(boost::asio::buffer(read_buffer_), [this](boost::system::error_code ec, size_t length) {
+			if(ec)
+			{
+				eof_ = ec == boost::asio::error::eof;
+				return;
+			}
+			received_.insert(received_.end(), read_buffer_.data(), read_buffer_.data() + length);
+			read_loop();
+		});
+	}
+
+	void settle()
+	{
+		io_context_.restart();
+		while(io_context_.poll() > 0)
+		{
+		}
+	}
+};
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+	if(!condition)
+	{
+		std::cerr << "FAILED: " << what << "\n";
+		++failures;
+	}
+}
+
+static uint16_t status_of(const std::string& body)
+{
+	return body.size() >= 2 ? static_cast<uint16_t>(static_cast<unsigned char>(body[0]) << 8 |
+													 static_cast<unsigned char>(body[1]))
+							: 0;
+}
+
+/// @brief Expects the echo response of seq carrying message as the next frame.
+static void expect_echo(test_bed& bed, uint8_t seq, const std::string& message, const std::string& what)
+{
+	PacketHeader header;
+	std::string body;
+	check(bed.next_frame(header, body), what + ": an echo response");
+	check(header.msg_type == ECHO_RESPONSE && header.msg_seq == seq, what + ": type and seq");
+	check(body.size() >= 2 && body.substr(2) == message, what + ": payload");
+}
+
+static void legacy_login()
+{
+	test_bed bed;
+	bed.login();
+
+	PacketHeader header;
+	std::string body;
+	check(bed.next_frame(header, body), "legacy login: a response");
+	check(header.msg_type == LOGIN_RESPONSE, "legacy login: LOGIN_RESPONSE");
+	check(header.msg_size == sizeof(LoginResponse), "legacy login: no capabilities in the response");
+	check(status_of(body) == 1, "legacy login: accepted");
+
+	bed.send(bed.echo_frame(1, "hello"));
+	expect_echo(bed, 1, "hello", "legacy login");
+}
+
+static void version_negotiation()
+{
+	// A later client offering bits this version doesn't define only gets the known ones
+	test_bed bed;
+	bed.login(PROTOCOL_VERSION + 1, 0xFFFFFFFFu);
+
+	PacketHeader header;
+	std::string body;
+	check(bed.next_frame(header, body), "negotiation: a response");
+	check(body.size() == sizeof(LoginResponse) - sizeof(PacketHeader) + sizeof(LoginCapabilities),
+		  "negotiation: capabilities in the response");
+	if(body.size() >= sizeof(uint16_t) + sizeof(LoginCapabilities))
+	{
+		LoginCapabilities accepted;
+		std::memcpy(&accepted, body.data() + sizeof(uint16_t), sizeof(accepted));
+		check(ntohs(accepted.version) == PROTOCOL_VERSION, "negotiation: the lower version");
+		check(ntohl(accepted.features) == protocol_features(PROTOCOL_VERSION), "negotiation: only known features");
+	}
+}
+
+static void split_frames()
+{
+	test_bed bed;
+	PacketHeader header;
+	std::string body;
+
+	std::vector<char> login = bed.login_frame();
+	bed.send(std::vector<char>(login.begin(), login.begin() + 10));
+	check(!bed.next_frame(header, body), "split login: no response to half a frame");
+	bed.send(std::vector<char>(login.begin() + 10, login.end()));
+	check(bed.next_frame(header, body) && header.msg_type == LOGIN_RESPONSE, "split login: answered once whole");
+
+	// Split inside the header, then inside the body
+	std::vector<char> echo = bed.echo_frame(1, "split across reads");
+	bed.send(std::vector<char>(echo.begin(), echo.begin() + 2));
+	bed.send(std::vector<char>(echo.begin() + 2, echo.begin() + 9));
+	check(!bed.next_frame(header, body), "split echo: no response to part of a frame");
+	bed.send(std::vector<char>(echo.begin() + 9, echo.end()));
+	expect_echo(bed, 1, "split across reads", "split echo");
+}
+
+static void header_size_too_small()
+{
+	test_bed bed;
+	bed.login();
+	PacketHeader header;
+	std::string body;
+	bed.next_frame(header, body);
+
+	PacketHeader invalid{};
+	invalid.msg_size = htons(sizeof(PacketHeader) - 2);
+	invalid.msg_type = ECHO_REQUEST;
+	std::vector<char> frame(reinterpret_cast<const char*>(&invalid),
+							reinterpret_cast<const char*>(&invalid) + sizeof(invalid));
+	bed.send(frame);
+
+	check(!bed.next_frame(header, body), "short msg_size: no response");
+	check(bed.closed(), "short msg_size: the session closes the stream");
+}
+
+static void payload_larger_than_body()
+{
+	test_bed bed;
+	bed.login();
+	PacketHeader header;
+	std::string body;
+	bed.next_frame(header, body);
+
+	bed.send(bed.echo_frame(1, "short", 100));
+	check(!bed.next_frame(header, body), "oversized payload_len: rejected without a response");
+	check(!bed.closed(), "oversized payload_len: the session keeps serving");
+
+	bed.send(bed.echo_frame(2, "after"));
+	expect_echo(bed, 2, "after", "oversized payload_len");
+}
+
+int main()
+{
+	legacy_login();
+	version_negotiation();
+	split_frames();
+	header_size_too_small();
+	payload_larger_than_body();
+
+	if(failures != 0)
+	{
+		std::cerr << failures << " checks failed\n";
+		return 1;
+	}
+	std::cout << "all protocol checks passed\n";
+	return 0;
+}
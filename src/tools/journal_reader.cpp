@@ -0,0 +1,86 @@
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+
+#include "server/journal.h"
+
+namespace po = boost::program_options;
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		std::vector<std::string> inputs;
+
+		po::options_description desc("Usage: journal_reader [options] <journal dir or segments>...");
+		desc.add_options()
+			("help,h", "Print this message")
+			("print,p", "Print every record instead of only the totals")
+			("input", po::value(&inputs), "Journal directories or segment files");
+
+		po::positional_options_description positional;
+		positional.add("input", -1);
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+
+		if(vm.count("help") || inputs.empty())
+		{
+			std::cout << desc << "\n";
+			return vm.count("help") ? 0 : 1;
+		}
+		bool print = vm.count("print") != 0;
+
+		std::vector<std::string> segments;
+		for(const auto& input : inputs)
+		{
+			if(std::filesystem::is_directory(input))
+			{
+				auto found = list_journal_segments(input);
+				segments.insert(segments.end(), found.begin(), found.end());
+			}
+			else
+			{
+				segments.push_back(input);
+			}
+		}
+
+		uint64_t records = 0;
+		uint64_t message_bytes = 0;
+		uint64_t file_bytes = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		for(const auto& path : segments)
+		{
+			journal_segment_reader reader(path);
+			file_bytes += std::filesystem::file_size(path);
+
+			journal_entry entry;
+			while(reader.next(entry))
+			{
+				++records;
+				message_bytes += entry.message.size();
+				if(print)
+				{
+					std::cout << entry.timestamp_ns << " " << entry.client_id << " #" << entry.seq << ": "
+							  << entry.message << "\n";
+				}
+			}
+		}
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cerr << records << " records (" << message_bytes << " message bytes) in " << segments.size()
+				  << " segments, " << file_bytes / (1024.0 * 1024.0) << " MiB scanned in " << elapsed
+				  << " s (" << file_bytes / (1024.0 * 1024.0) / elapsed << " MiB/s)\n";
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,523 @@
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include "server/capture.h"
+#include "utils/crypto.hpp"
+#include "utils/types.h"
+
+namespace po = boost::program_options;
+using boost::asio::ip::tcp;
+using replay_clock = std::chrono::steady_clock;
+
+struct replay_options
+{
+	std::string host{"127.0.0.1"};
+	uint16_t port{12345};
+	int copies{1};
+	bool unique_users{false};
+	bool asap{false};
+	double speed{1.0};
+};
+
+/// @brief Key material of one direction of a connection, enough to decrypt
+/// or encrypt the payload of any of its echo or broadcast requests.
+struct payload_cipher
+{
+	uint8_t username_sum{0};
+	uint8_t password_sum{0};
+	uint32_t features{0};
+	chacha20_key key{};
+
+	std::vector<uint8_t> apply(uint8_t seq, const char* data, uint16_t size) const
+	{
+		if(features & FEATURE_CHACHA20)
+		{
+			return chacha20_operation(size, key, seq, data);
+		}
+		return xor_operation(size, compute_initial_key(seq, username_sum, password_sum), data);
+	}
+};
+
+/// @brief One connection found in the capture, the frames point into the mapped file.
+struct captured_connection
+{
+	const LoginRequest* login{nullptr};
+	bool negotiated{false};
+	LoginCapabilities client_capabilities{};
+	payload_cipher cipher;
+	uint64_t first_timestamp{0};
+	std::vector<capture_entry> frames;
+};
+
+struct replay_stats
+{
+	uint64_t connections{0};
+	uint64_t failed{0};
+	uint64_t frames_sent{0};
+	uint64_t bytes_sent{0};
+	uint64_t echoes_sent{0};
+	uint64_t echoes_received{0};
+};
+
+/// @brief Indexes the client frames of every connection and recovers the
+/// ciphers they were encrypted with from the captured logins.
+static std::map<uint64_t, captured_connection> load_capture(capture_reader& reader, uint64_t& capture_start)
+{
+	std::map<uint64_t, captured_connection> connections;
+	uint64_t skipped = 0;
+	capture_start = UINT64_MAX;
+
+	capture_entry entry;
+	while(reader.next(entry))
+	{
+		if(entry.size < sizeof(PacketHeader))
+		{
+			continue;
+		}
+		PacketHeader header;
+		std::memcpy(&header, entry.data, sizeof(header));
+		captured_connection& c = connections[entry.connection];
+
+		if(entry.direction == SERVER_TO_CLIENT)
+		{
+			// The nonce the server picked is needed to decrypt a negotiated ChaCha20 stream
+			if(header.msg_type == LOGIN_RESPONSE && c.negotiated &&
+			   entry.size >= sizeof(LoginResponse) + sizeof(LoginCapabilities))
+			{
+				LoginCapabilities accepted;
+				std::memcpy(&accepted, entry.data + sizeof(LoginResponse), sizeof(accepted));
+				c.cipher.features = ntohl(accepted.features);
+				if(c.cipher.features & FEATURE_CHACHA20)
+				{
+					c.cipher.key = derive_chacha20_key(c.cipher.username_sum,
+													   c.cipher.password_sum,
+													   ntohl(c.client_capabilities.nonce),
+													   ntohl(accepted.nonce));
+				}
+			}
+			continue;
+		}
+
+		if(header.msg_type == LOGIN_REQUEST)
+		{
+			if(c.login != nullptr || entry.size < sizeof(LoginRequest))
+			{
+				++skipped;
+				continue;
+			}
+			c.login = reinterpret_cast<const LoginRequest*>(entry.data);
+			c.first_timestamp = entry.timestamp_ns;
+			c.cipher.username_sum = compute_checksum_cstr(c.login->username, sizeof(c.login->username));
+			c.cipher.password_sum = compute_checksum_cstr(c.login->password, sizeof(c.login->password));
+			if(entry.size >= sizeof(LoginRequest) + sizeof(LoginCapabilities))
+			{
+				c.negotiated = true;
+				std::memcpy(&c.client_capabilities, entry.data + sizeof(LoginRequest), sizeof(LoginCapabilities));
+			}
+			capture_start = std::min(capture_start, entry.timestamp_ns);
+		}
+		else if(c.login == nullptr)
+		{
+			// Without the login the keys of the connection are unknown
+			++skipped;
+		}
+		else
+		{
+			c.frames.push_back(entry);
+		}
+	}
+
+	for(auto it = connections.begin(); it != connections.end();)
+	{
+		it = it->second.login == nullptr ? connections.erase(it) : std::next(it);
+	}
+	if(skipped != 0)
+	{
+		std::cerr << "Skipped " << skipped << " frames sent before a login or after a second one\n";
+	}
+	return connections;
+}
+
+/// @brief Replays the captured frames of one connection over a new socket.
+class replay_connection : public std::enable_shared_from_this<replay_connection>
+{
+public:
+	replay_connection(boost::asio::io_context& io_context,
+					  const tcp::endpoint& endpoint,
+					  const captured_connection& captured,
+					  const replay_options& options,
+					  replay_clock::time_point replay_start,
+					  uint64_t capture_start,
+					  int copy,
+					  replay_stats& stats)
+		: socket_(io_context)
+		, timer_(io_context)
+		, endpoint_(endpoint)
+		, captured_(captured)
+		, options_(options)
+		, replay_start_(replay_start)
+		, capture_start_(capture_start)
+		, copy_(copy)
+		, stats_(stats)
+	{ }
+
+	void start()
+	{
+		auto self(shared_from_this());
+		timer_.expires_at(due(captured_.first_timestamp));
+		timer_.async_wait([this, self](boost::system::error_code) {
+			socket_.async_connect(endpoint_, [this, self](boost::system::error_code ec) {
+				if(ec)
+				{
+					fail("Connect error: " + ec.message());
+					return;
+				}
+				socket_.set_option(tcp::no_delay(true));
+				++stats_.connections;
+				send_login();
+			});
+		});
+	}
+
+private:
+	tcp::socket socket_;
+	boost::asio::steady_timer timer_;
+	tcp::endpoint endpoint_;
+	const captured_connection& captured_;
+	const replay_options& options_;
+	replay_clock::time_point replay_start_;
+	uint64_t capture_start_;
+	int copy_;
+	replay_stats& stats_;
+
+	payload_cipher cipher_;
+	uint32_t client_nonce_{0};
+	uint8_t msg_seq_{0};
+	size_t next_frame_{0};
+	uint64_t echoes_sent_{0};
+	uint64_t echoes_received_{0};
+	bool sending_done_{false};
+	std::vector<char> out_;
+	std::vector<char> in_;
+	size_t in_size_{0};
+	bool logged_in_{false};
+
+	replay_clock::time_point due(uint64_t timestamp_ns) const
+	{
+		if(options_.asap)
+		{
+			return replay_start_;
+		}
+		auto offset = std::chrono::nanoseconds(static_cast<int64_t>((timestamp_ns - capture_start_) / options_.speed));
+		return replay_start_ + std::chrono::duration_cast<replay_clock::duration>(offset);
+	}
+
+	void fail(const std::string& message)
+	{
+		std::cerr << message << "\n";
+		++stats_.failed;
+		boost::system::error_code ec;
+		socket_.close(ec);
+	}
+
+	/// @brief Sends the captured login, with the username made unique per copy if asked.
+	void send_login()
+	{
+		LoginRequest login = *captured_.login;
+		login.header.msg_seq = msg_seq_++;
+
+		if(options_.unique_users && options_.copies > 1)
+		{
+			std::string username(login.username, strnlen(login.username, sizeof(login.username)));
+			std::string suffix = "." + std::to_string(copy_);
+			username = username.substr(0, sizeof(login.username) - 1 - suffix.size()) + suffix;
+			std::memset(login.username, 0, sizeof(login.username));
+			std::memcpy(login.username, username.data(), username.size());
+		}
+
+		// The checksums of the new login are the ones the server computes the keys from
+		cipher_.username_sum = compute_checksum_cstr(login.username, sizeof(login.username));
+		cipher_.password_sum = compute_checksum_cstr(login.password, sizeof(login.password));
+
+		out_.assign(reinterpret_cast<const char*>(&login), reinterpret_cast<const char*>(&login) + sizeof(login));
+		if(captured_.negotiated)
+		{
+			LoginCapabilities capabilities = captured_.client_capabilities;
+			client_nonce_ = ntohl(capabilities.nonce) ^ static_cast<uint32_t>(copy_ * 2654435761u);
+			capabilities.nonce = htonl(client_nonce_);
+			out_.insert(out_.end(),
+						reinterpret_cast<const char*>(&capabilities),
+						reinterpret_cast<const char*>(&capabilities) + sizeof(capabilities));
+		}
+
+		++stats_.frames_sent;
+		stats_.bytes_sent += out_.size();
+
+		auto self(shared_from_this());
+		boost::asio::async_write(socket_, boost::asio::buffer(out_), [this, self](boost::system::error_code ec, std::size_t) {
+			if(ec)
+			{
+				fail("Login send error: " + ec.message());
+				return;
+			}
+			in_.resize(64 * 1024);
+			read_responses();
+		});
+	}
+
+	void handle_login_response(const char* frame, size_t size)
+	{
+		if(size < sizeof(LoginResponse) || frame[sizeof(PacketHeader) + 1] != 1)
+		{
+			fail("Login refused");
+			return;
+		}
+
+		if(size >= sizeof(LoginResponse) + sizeof(LoginCapabilities))
+		{
+			LoginCapabilities accepted;
+			std::memcpy(&accepted, frame + sizeof(LoginResponse), sizeof(accepted));
+			cipher_.features = ntohl(accepted.features);
+			if(cipher_.features & FEATURE_CHACHA20)
+			{
+				cipher_.key = derive_chacha20_key(
+					cipher_.username_sum, cipher_.password_sum, client_nonce_, ntohl(accepted.nonce));
+			}
+		}
+
+		logged_in_ = true;
+		send_frames();
+	}
+
+	/// @brief Appends a captured frame with its seq rewritten and its payload
+	/// re-encrypted for the keys of this connection.
+	void append_frame(const capture_entry& frame)
+	{
+		PacketHeader header;
+		std::memcpy(&header, frame.data, sizeof(header));
+		uint8_t captured_seq = header.msg_seq;
+		header.msg_seq = msg_seq_++;
+
+		size_t start = out_.size();
+		out_.insert(out_.end(), frame.data, frame.data + frame.size);
+		std::memcpy(out_.data() + start, &header, sizeof(header));
+
+		bool ciphered = header.msg_type == ECHO_REQUEST || header.msg_type == BROADCAST_REQUEST;
+		if(ciphered && frame.size >= sizeof(EchoRequest))
+		{
+			uint16_t payload_len;
+			std::memcpy(&payload_len, frame.data + sizeof(PacketHeader), sizeof(payload_len));
+			payload_len = std::min<uint16_t>(ntohs(payload_len), frame.size - sizeof(EchoRequest));
+
+			const char* cipher = frame.data + sizeof(EchoRequest);
+			std::vector<uint8_t> plain = captured_.cipher.apply(captured_seq, cipher, payload_len);
+			std::vector<uint8_t> replayed =
+				cipher_.apply(header.msg_seq, reinterpret_cast<const char*>(plain.data()), payload_len);
+			std::memcpy(out_.data() + start + sizeof(EchoRequest), replayed.data(), payload_len);
+		}
+
+		if(header.msg_type == ECHO_REQUEST)
+		{
+			++echoes_sent_;
+			++stats_.echoes_sent;
+		}
+		++stats_.frames_sent;
+		stats_.bytes_sent += frame.size;
+	}
+
+	/// @brief Writes every frame that is due, as fast as possible in asap mode.
+	void send_frames()
+	{
+		out_.clear();
+		auto now = replay_clock::now();
+		while(next_frame_ < captured_.frames.size() &&
+			  due(captured_.frames[next_frame_].timestamp_ns) <= now)
+		{
+			append_frame(captured_.frames[next_frame_++]);
+		}
+
+		auto self(shared_from_this());
+		if(out_.empty())
+		{
+			if(next_frame_ == captured_.frames.size())
+			{
+				sending_done_ = true;
+				finish_if_done();
+				return;
+			}
+			timer_.expires_at(due(captured_.frames[next_frame_].timestamp_ns));
+			timer_.async_wait([this, self](boost::system::error_code ec) {
+				if(!ec)
+				{
+					send_frames();
+				}
+			});
+			return;
+		}
+
+		boost::asio::async_write(socket_, boost::asio::buffer(out_), [this, self](boost::system::error_code ec, std::size_t) {
+			if(ec)
+			{
+				fail("Send error: " + ec.message());
+				return;
+			}
+			send_frames();
+		});
+	}
+
+	void read_responses()
+	{
+		auto self(shared_from_this());
+		socket_.async_read_some(boost::asio::buffer(in_.data() + in_size_, in_.size() - in_size_),
+								[this, self](boost::system::error_code ec, std::size_t length) {
+									if(ec)
+									{
+										return;
+									}
+									in_size_ += length;
+									if(parse_responses())
+									{
+										read_responses();
+									}
+								});
+	}
+
+	/// @brief Counts the responses, returns false once the connection is done.
+	bool parse_responses()
+	{
+		size_t offset = 0;
+		while(in_size_ - offset >= sizeof(PacketHeader))
+		{
+			PacketHeader header;
+			std::memcpy(&header, in_.data() + offset, sizeof(header));
+			size_t frame_size = ntohs(header.msg_size);
+			if(frame_size < sizeof(PacketHeader))
+			{
+				fail("Invalid frame from the server");
+				return false;
+			}
+			if(in_size_ - offset < frame_size)
+			{
+				break;
+			}
+
+			if(header.msg_type == LOGIN_RESPONSE && !logged_in_)
+			{
+				handle_login_response(in_.data() + offset, frame_size);
+				if(!socket_.is_open())
+				{
+					return false;
+				}
+			}
+			else if(header.msg_type == ECHO_RESPONSE)
+			{
+				++echoes_received_;
+				++stats_.echoes_received;
+			}
+			offset += frame_size;
+		}
+
+		std::memmove(in_.data(), in_.data() + offset, in_size_ - offset);
+		in_size_ -= offset;
+		return !finish_if_done();
+	}
+
+	bool finish_if_done()
+	{
+		if(sending_done_ && echoes_received_ >= echoes_sent_)
+		{
+			boost::system::error_code ec;
+			socket_.shutdown(tcp::socket::shutdown_both, ec);
+			socket_.close(ec);
+			return true;
+		}
+		return false;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		replay_options options;
+		std::string capture_file;
+
+		po::options_description desc("Usage: replay [options] <capture file>");
+		desc.add_options()
+			("help,h", "Print this message")
+			("host", po::value(&options.host)->default_value(options.host), "Server address")
+			("port,p", po::value(&options.port)->default_value(options.port), "Server port")
+			("copies,c", po::value(&options.copies)->default_value(options.copies),
+			 "How many times every captured connection is replayed concurrently")
+			("unique-users", "Give every copy its own username so they don't share a client_id")
+			("asap", "Send every frame as fast as possible instead of at the captured times")
+			("speed", po::value(&options.speed)->default_value(options.speed),
+			 "Speed up (or slow down) the captured timing")
+			("capture", po::value(&capture_file), "Capture file recorded by the server");
+
+		po::positional_options_description positional;
+		positional.add("capture", 1);
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+
+		if(vm.count("help") || capture_file.empty())
+		{
+			std::cout << desc << "\n";
+			return vm.count("help") ? 0 : 1;
+		}
+		options.unique_users = vm.count("unique-users") != 0;
+		options.asap = vm.count("asap") != 0;
+		if(options.speed <= 0)
+		{
+			options.speed = 1.0;
+		}
+
+		capture_reader reader(capture_file);
+		uint64_t capture_start = 0;
+		auto connections = load_capture(reader, capture_start);
+		if(connections.empty())
+		{
+			std::cerr << "No replayable connection in " << capture_file << "\n";
+			return 1;
+		}
+
+		boost::asio::io_context io_context;
+		tcp::resolver resolver(io_context);
+		tcp::endpoint endpoint = *resolver.resolve(options.host, std::to_string(options.port)).begin();
+
+		replay_stats stats;
+		auto start = replay_clock::now();
+		for(const auto& entry : connections)
+		{
+			for(int copy = 0; copy < options.copies; ++copy)
+			{
+				std::make_shared<replay_connection>(
+					io_context, endpoint, entry.second, options, start, capture_start, copy, stats)
+					->start();
+			}
+		}
+		io_context.run();
+
+		double elapsed = std::chrono::duration<double>(replay_clock::now() - start).count();
+		std::cout << "replayed " << connections.size() << " captured connections x " << options.copies
+				  << " (" << stats.connections << " connected, " << stats.failed << " failed) in "
+				  << elapsed << " s\n";
+		std::cout << stats.frames_sent << " frames, " << stats.bytes_sent << " bytes sent, "
+				  << stats.echoes_received << "/" << stats.echoes_sent << " echoes answered, "
+				  << stats.echoes_received / elapsed << " echoes/s\n";
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}